@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define THREAD_NEW 0
+#define THREAD_SEEN 1
+#define THREAD_REGISTERED 2
+#define THREAD_EXITED 3
+
+struct arena arenas[MAX_ARENAS] = {
+	[0 ... MAX_ARENAS - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER },
+};
+
+// arenas handed out so far, arena 0 included
+int arenas_used = 1;
+
+// the allocator goes multi-threaded once a second thread calls it
+static int threads_seen;
+static int multi_threaded;
+
+static pthread_mutex_t assign_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+
+static __thread struct arena *my_arena __attribute__((tls_model("initial-exec")));
+static __thread int thread_state __attribute__((tls_model("initial-exec")));
+
+// give the cache and the arena of an exiting thread back
+static void thread_exit(void *arg)
+{
+	(void)arg;
+
+	tcache_destroy();
+	pool_thread_exit();
+	trace_thread_exit();
+	if (my_arena)
+		__atomic_fetch_sub(&my_arena->threads, 1, __ATOMIC_RELAXED);
+	my_arena = NULL;
+	thread_state = THREAD_EXITED;
+}
+
+static void thread_key_init(void)
+{
+	pthread_key_create(&thread_key, thread_exit);
+}
+
+// have thread_exit() called when the calling thread exits
+void thread_register(void)
+{
+	if (thread_state != THREAD_SEEN)
+		return;
+
+	pthread_once(&thread_key_once, thread_key_init);
+	pthread_setspecific(thread_key, &thread_state);
+	thread_state = THREAD_REGISTERED;
+}
+
+// take every lock of the allocator, so that no other thread holds one at
+// fork() and the child finds the heaps consistent; in the order they nest
+static void fork_prepare(void)
+{
+	pool_fork_lock();
+	pthread_mutex_lock(&purge_mutex);
+	pthread_mutex_lock(&assign_mutex);
+	for (int i = 0; i < MAX_ARENAS; i++)
+		pthread_mutex_lock(&arenas[i].mutex);
+	pthread_mutex_lock(&zone_mutex);
+	pthread_mutex_lock(&map_mutex);
+	pthread_mutex_lock(&large_mutex);
+	pthread_mutex_lock(&prof_mutex);
+	pthread_mutex_lock(&trace_mutex);
+}
+
+static void fork_parent(void)
+{
+	pthread_mutex_unlock(&trace_mutex);
+	pthread_mutex_unlock(&prof_mutex);
+	pthread_mutex_unlock(&large_mutex);
+	pthread_mutex_unlock(&map_mutex);
+	pthread_mutex_unlock(&zone_mutex);
+	for (int i = MAX_ARENAS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&arenas[i].mutex);
+	pthread_mutex_unlock(&assign_mutex);
+	pthread_mutex_unlock(&purge_mutex);
+	pool_fork_unlock();
+}
+
+// the child is left with the forking thread only, which owns the locks
+static void fork_child(void)
+{
+	trace_fork_child();
+	pthread_mutex_init(&prof_mutex, NULL);
+	pthread_mutex_init(&large_mutex, NULL);
+	pthread_mutex_init(&map_mutex, NULL);
+	pthread_mutex_init(&zone_mutex, NULL);
+	for (int i = 0; i < MAX_ARENAS; i++)
+		pthread_mutex_init(&arenas[i].mutex, NULL);
+	pthread_mutex_init(&assign_mutex, NULL);
+	pthread_mutex_init(&purge_mutex, NULL);
+	pool_fork_child();
+}
+
+static void fork_init(void)
+{
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// check if more than one thread has called into the allocator
+int threads_multi(void)
+{
+	if (thread_state == THREAD_NEW) {
+		thread_state = THREAD_SEEN;
+		tunables_init();
+		pthread_once(&fork_once, fork_init);
+		pthread_once(&trace_env_once, trace_env);
+		if (__atomic_fetch_add(&threads_seen, 1, __ATOMIC_RELAXED))
+			__atomic_store_n(&multi_threaded, 1, __ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(&multi_threaded, __ATOMIC_RELAXED);
+}
+
+// obtain the number of arenas threads are spread across
+static int arena_count(void)
+{
+	int count = tunable(OS_M_ARENAS);
+
+	if (!count) {
+		// one arena per CPU the process may run on
+		cpu_set_t set;
+
+		count = sched_getaffinity(0, sizeof(set), &set) ? 1 : CPU_COUNT(&set);
+	}
+	return count < MAX_ARENAS ? count : MAX_ARENAS;
+}
+
+// assign the calling thread to the arena with the fewest threads
+static struct arena *assign_arena(void)
+{
+	int count = arena_count();
+	int best = 0;
+
+	pthread_mutex_lock(&assign_mutex);
+	for (int i = 1; i < count; i++)
+		if (arenas[i].threads < arenas[best].threads)
+			best = i;
+	__atomic_fetch_add(&arenas[best].threads, 1, __ATOMIC_RELAXED);
+	if (best >= arenas_used)
+		__atomic_store_n(&arenas_used, best + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&assign_mutex);
+
+	return &arenas[best];
+}
+
+// obtain the arena the calling thread allocates from
+struct arena *thread_arena(void)
+{
+	if (my_arena)
+		return my_arena;
+
+	// a single thread, or one that is exiting, uses the sbrk heap
+	if (!threads_multi() || thread_state == THREAD_EXITED)
+		return &arenas[0];
+
+	my_arena = assign_arena();
+	thread_register();
+	return my_arena;
+}
+
+// free a heap block or slab slot of another arena onto the remote list of
+// that arena, without taking its lock; false if the block is to be freed here
+int remote_free(struct span *span, void *ptr)
+{
+	struct arena *arena = span->arena;
+
+	if (!tunable(OS_M_REMOTE_FREE) || !threads_multi() || arena == my_arena)
+		return 0;
+
+	// a heap block on the list is not free yet, nor to be freed again
+	if (span->kind == SPAN_HEAP)
+		((struct block_meta *)ptr - 1)->status = STATUS_CACHED;
+
+	void *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+
+	do
+		*(void **)ptr = head;
+	while (!__atomic_compare_exchange_n(&arena->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return 1;
+}
+
+// bin the blocks on the remote list of an arena, called with the arena locked
+void remote_bin(struct arena *arena)
+{
+	// taking the whole list at once leaves pushers nothing to race with
+	void *ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+
+	while (ptr) {
+		void *next = *(void **)ptr;
+		struct span *span = page_span(ptr);
+
+		if (span->kind == SPAN_SLAB)
+			slab_free_locked(span, ptr);
+		else
+			heap_free(arena, (struct block_meta *)ptr - 1);
+		arena->remote_frees++;
+		ptr = next;
+	}
+}
+
+int os_malloc_arena_stats(struct os_arena_stats *stats, int count)
+{
+	int used = __atomic_load_n(&arenas_used, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < used && i < count; i++) {
+		struct arena *arena = &arenas[i];
+
+		pthread_mutex_lock(&arena->mutex);
+		stats[i].segments = arena->segments;
+		stats[i].lock_acquisitions = arena->locks;
+		stats[i].lock_contentions = arena->contended;
+		stats[i].threads = __atomic_load_n(&arena->threads, __ATOMIC_RELAXED);
+		stats[i].remote_frees = arena->remote_frees;
+		pthread_mutex_unlock(&arena->mutex);
+	}
+	return used;
+}
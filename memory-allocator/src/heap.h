@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "block_meta.h"
+
+#define MMAP_THRESHOLD (128 * 1024)
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+/* Largest request; its header and its rounding up to huge pages stay below PTRDIFF_MAX */
+#define MAX_ALLOC_SIZE (PTRDIFF_MAX - 2 * HUGE_PAGE)
+#define N_ALIGN_N OS_MALLOC_ALIGNMENT
+#define ALIGN_SIZE(size) (((size) + N_ALIGN_N - 1) & ~(size_t)(N_ALIGN_N - 1))
+#define BLOCK_SIZE sizeof(struct block_meta)
+#define NUM_EXACT_BINS 128
+#define NUM_BINS (NUM_EXACT_BINS + 16)	/* power of two bins from 1 KiB up to MMAP_THRESHOLD_MAX */
+#define BIN_MAP_WORDS ((NUM_BINS + 63) / 64)
+#define MAX_ARENAS 64
+#define SEGMENT_SIZE (1024 * 1024)
+#define SLAB_SIZE 4096
+#define SLAB_MIN_SLOT 16
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_MIN_SLOT)
+#define PAGE_SHIFT 12
+#define MAP_PAGE (1UL << PAGE_SHIFT)
+#define HUGE_PAGE (2UL << 20)
+#define PAGE_MAP_BITS 12
+#define PAGE_MAP_NODE (1 << PAGE_MAP_BITS)
+#define DUMP_BUFFER 256
+
+#define SPAN_HEAP 1
+#define SPAN_SLAB 2
+
+struct slab;
+struct os_purge_stats;
+struct os_malloc_stats;
+
+/*
+ * Descriptor of a run of pages, found through the page map: every page of
+ * the sbrk heap and of the segments of an arena points to the span of the
+ * arena, every slab page to the span at the start of the slab. Pages of
+ * mmap'd blocks are not in the map.
+ */
+struct span {
+	struct arena *arena;
+	unsigned int kind;
+	unsigned int size_class;	/* slot size of a slab */
+};
+
+/*
+ * An independent heap with its own lock and free lists. Arena 0 is the sbrk
+ * heap; the others grow by SEGMENT_SIZE mmap segments, each holding its own
+ * list of physically adjacent blocks. Threads of other arenas free into the
+ * remote list, a lock-free stack linked through the payloads, which the
+ * arena bins in one go when it is next locked to allocate.
+ */
+struct arena {
+	pthread_mutex_t mutex;
+	struct span span;		/* span of all heap pages of the arena */
+	struct block_meta *base;	/* first block of the sbrk heap */
+	struct block_meta *last;	/* last block of the sbrk heap */
+	struct block_meta *deferred;	/* old block of the last moved realloc */
+	struct block_meta *bins[NUM_BINS];
+	uint64_t bin_map[BIN_MAP_WORDS];
+	struct slab *slabs[SLAB_CLASSES];	/* slabs with free slots, per size class */
+	void *remote;			/* blocks freed by other threads, not binned yet */
+	unsigned long remote_frees;
+	unsigned long locks;
+	unsigned long contended;
+	size_t segments;
+	int threads;
+};
+
+/*
+ * Counters behind os_malloc_stats(): the system calls made, and the mmap'd
+ * blocks handed out and not freed yet.
+ */
+struct counters {
+	unsigned long sbrk;
+	unsigned long mmap;
+	unsigned long munmap;
+	unsigned long mremap;
+	unsigned long madvise;
+	long mapped;
+	long mapped_blocks;
+};
+
+/* Text on its way to a file descriptor, in a buffer on the stack */
+struct dump {
+	int fd;
+	size_t len;
+	char buf[DUMP_BUFFER];
+};
+
+extern struct counters counters;
+extern struct arena arenas[MAX_ARENAS];
+extern int arenas_used;
+extern unsigned long purge_clock;
+extern void *page_map[PAGE_MAP_NODE];
+
+// obtain the span of the page ptr lies in, NULL if it is not in the map
+static inline struct span *page_span(const void *ptr)
+{
+	uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+	void **node = __atomic_load_n(&page_map[(page >> (2 * PAGE_MAP_BITS)) & (PAGE_MAP_NODE - 1)],
+				      __ATOMIC_ACQUIRE);
+
+	if (!node)
+		return NULL;
+
+	struct span **leaf = __atomic_load_n(&node[(page >> PAGE_MAP_BITS) & (PAGE_MAP_NODE - 1)],
+					     __ATOMIC_ACQUIRE);
+
+	if (!leaf)
+		return NULL;
+	return __atomic_load_n(&leaf[page & (PAGE_MAP_NODE - 1)], __ATOMIC_ACQUIRE);
+}
+
+// obtain the arena a heap block belongs to
+static inline struct arena *arena_of(struct block_meta *block)
+{
+	return page_span(block)->arena;
+}
+
+// obtain the length of the mapping of an mmap'd block of size bytes
+static inline size_t map_length(size_t size)
+{
+	return (size + BLOCK_SIZE + MAP_PAGE - 1) & ~(MAP_PAGE - 1);
+}
+
+// obtain the slab size class of an allocation of size bytes
+static inline size_t slab_class(size_t size)
+{
+	return size ? (size - 1) / SLAB_MIN_SLOT : 0;
+}
+
+// account for mmap'd blocks handed out (positive) or freed (negative)
+static inline void count_mapped(long bytes, long blocks)
+{
+	__atomic_fetch_add(&counters.mapped, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters.mapped_blocks, blocks, __ATOMIC_RELAXED);
+}
+
+// lock an arena, counting the acquisitions that had to wait
+static inline void arena_lock(struct arena *arena)
+{
+	if (pthread_mutex_trylock(&arena->mutex)) {
+		pthread_mutex_lock(&arena->mutex);
+		arena->contended++;
+	}
+	arena->locks++;
+}
+
+static inline void arena_unlock(struct arena *arena)
+{
+	pthread_mutex_unlock(&arena->mutex);
+}
+
+/* Heap internals (osmem.c), called with the arena locked */
+void *heap_malloc(struct arena *arena, size_t size);
+void heap_free(struct arena *arena, struct block_meta *block);
+size_t heap_malloc_run(struct arena *arena, size_t size, size_t count, void **ptrs);
+void heap_purge(struct arena *arena, unsigned long now, int force, struct os_purge_stats *stats);
+
+/* The untraced calls behind the public ones (osmem.c) */
+void *do_malloc(size_t size, int flags);
+void do_free(void *ptr);
+
+/* mmap'd blocks (osmem.c) */
+void *map_block(size_t size, int flags);
+void *map_aligned(size_t size, size_t align);
+
+/* Locks of the modules, all taken around fork() (arena.c) */
+extern pthread_mutex_t purge_mutex;
+extern pthread_mutex_t zone_mutex;
+extern pthread_mutex_t map_mutex;
+extern pthread_mutex_t large_mutex;
+extern pthread_mutex_t prof_mutex;
+extern pthread_mutex_t trace_mutex;
+
+/* Threads and arenas (arena.c) */
+int threads_multi(void);
+struct arena *thread_arena(void);
+void thread_register(void);
+int remote_free(struct span *span, void *ptr);
+void remote_bin(struct arena *arena);
+
+// bin the blocks freed to an arena by other threads, called with the arena locked
+static inline void remote_drain(struct arena *arena)
+{
+	if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED))
+		remote_bin(arena);
+}
+
+/* Page map (pagemap.c) */
+int page_map_set(void *start, size_t size, struct span *span);
+void page_map_walk(void (*fn)(char *start, size_t size, struct span *span, void *arg), void *arg);
+
+/* Cache of freed mmap'd blocks (largecache.c) */
+struct block_meta *large_cache_get(size_t size);
+int large_cache_put(struct block_meta *block);
+size_t large_cache_decay(unsigned long decay);
+size_t large_cache_size(void);
+unsigned long now_ms(void);
+
+/* Background purger (purge.c) */
+void purge_start(void);
+
+/* Sampling heap profiler (prof.c) */
+extern long prof_live;
+extern __thread long prof_left __attribute__((tls_model("initial-exec")));
+void *prof_malloc(size_t size, size_t align, int flags);
+int prof_free(struct block_meta *block);
+void prof_move(void *old_ptr, void *new_ptr);
+
+// count size bytes towards the next sample of the calling thread, true once it is due
+static inline int prof_tick(size_t size)
+{
+	prof_left -= size;
+	return prof_left < 0;
+}
+
+/* Object pools (pool.c) */
+void pool_thread_exit(void);
+void pool_fork_lock(void);
+void pool_fork_unlock(void);
+void pool_fork_child(void);
+
+/* Trace recorder (trace.c) */
+extern int tracing;
+void trace_record(uint32_t op, unsigned long start, const void *ptr, size_t size, const void *result);
+void trace_thread_exit(void);
+void trace_fork_child(void);
+void trace_env(void);
+
+static inline unsigned long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// the time a call into the allocator starts at, if a trace is being recorded
+static inline unsigned long trace_clock(void)
+{
+	return __atomic_load_n(&tracing, __ATOMIC_RELAXED) ? trace_now() : 0;
+}
+
+// record a call into the allocator that started at start, if a trace is being recorded
+static inline void trace(uint32_t op, unsigned long start, const void *ptr, size_t size, const void *result)
+{
+	if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		trace_record(op, start, ptr, size, result);
+}
+
+/* Slabs for small objects (slab.c) */
+extern char *slab_zone;
+void *slab_malloc(struct arena *arena, size_t size);
+void slab_free(struct span *span, void *ptr);
+void slab_free_locked(struct span *span, void *ptr);
+void slab_stats(struct os_malloc_stats *stats);
+
+/* Thread caches (tcache.c) */
+int tcache_enabled(void);
+void *tcache_get(struct arena *arena, size_t size);
+int tcache_put(struct block_meta *block);
+void tcache_destroy(void);
+
+/* Counted system calls (stats.c) */
+void *sys_sbrk(intptr_t increment);
+void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+int sys_munmap(void *addr, size_t length);
+void *sys_mremap(void *addr, size_t old_length, size_t new_length, int flags);
+int sys_madvise(void *addr, size_t length, int advice);
+int sys_mprotect(void *addr, size_t length, int prot);
+int stats_class(size_t size);
+void dump_char(char character, void *arg);
+void dump_flush(struct dump *dump);
+
+/* Tunables (tunables.c) */
+void tunables_init(void);
+int tunable(int param);
+void tunable_raise(int param, int value);
+
+// obtain the smallest block, header included, that is mmap'd rather than taken from a heap
+static inline size_t mmap_threshold(void)
+{
+	return tunable(OS_M_MMAP_THRESHOLD);
+}
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define LARGE_BUCKETS 16
+#define LARGE_MIN_SHIFT 17
+
+/*
+ * Freed mmap'd blocks waiting to be reused, bucketed by the power of two of
+ * their mapping length. A cached block keeps its header, with prev and next
+ * linking it in its bucket (newest first), and the time it was cached in
+ * its payload.
+ */
+static struct block_meta *large_buckets[LARGE_BUCKETS];
+static struct block_meta *large_oldest[LARGE_BUCKETS];
+static size_t large_cached;
+pthread_mutex_t large_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// obtain the current time in milliseconds
+unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+// obtain the time a block was cached at
+static inline unsigned long *cached_time(struct block_meta *block)
+{
+	return (unsigned long *)(block + 1);
+}
+
+// obtain the bucket of a mapping length
+static inline size_t large_bucket(size_t length)
+{
+	size_t index = 63 - __builtin_clzl(length);
+
+	if (index < LARGE_MIN_SHIFT)
+		return 0;
+	index -= LARGE_MIN_SHIFT;
+	return index < LARGE_BUCKETS ? index : LARGE_BUCKETS - 1;
+}
+
+// remove a block from its bucket
+static void large_unlink(size_t index, struct block_meta *block)
+{
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		large_buckets[index] = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	else
+		large_oldest[index] = block->prev;
+	large_cached -= map_length(block->size);
+}
+
+// take the oldest cached block out of the cache, NULL if it is empty or if
+// the oldest block was cached after since
+static struct block_meta *large_evict(unsigned long since)
+{
+	struct block_meta *oldest = NULL;
+	size_t oldest_index = 0;
+
+	for (size_t i = 0; i < LARGE_BUCKETS; i++) {
+		struct block_meta *block = large_oldest[i];
+
+		if (block && (!oldest || *cached_time(block) < *cached_time(oldest))) {
+			oldest = block;
+			oldest_index = i;
+		}
+	}
+
+	if (!oldest || *cached_time(oldest) > since)
+		return NULL;
+
+	large_unlink(oldest_index, oldest);
+	return oldest;
+}
+
+// unmap a list of evicted blocks, linked through next
+static void large_release(struct block_meta *block)
+{
+	while (block) {
+		struct block_meta *next = block->next;
+
+		sys_munmap(block, map_length(block->size));
+		block = next;
+	}
+}
+
+// release the blocks cached for longer than decay milliseconds, return the bytes released
+size_t large_cache_decay(unsigned long decay)
+{
+	unsigned long now = now_ms();
+	struct block_meta *evicted = NULL;
+	size_t released = 0;
+
+	pthread_mutex_lock(&large_mutex);
+	for (;;) {
+		struct block_meta *block = large_evict(now >= decay ? now - decay : 0);
+
+		if (!block)
+			break;
+		released += map_length(block->size);
+		block->next = evicted;
+		evicted = block;
+	}
+	pthread_mutex_unlock(&large_mutex);
+
+	large_release(evicted);
+	return released;
+}
+
+// obtain a cached block that can hold size bytes without wasting more than a quarter of it
+struct block_meta *large_cache_get(size_t size)
+{
+	size_t length = map_length(size);
+	size_t index = large_bucket(length);
+	struct block_meta *best = NULL;
+	size_t best_index = 0;
+
+	pthread_mutex_lock(&large_mutex);
+	for (size_t i = index; i < LARGE_BUCKETS && i <= index + 1; i++) {
+		for (struct block_meta *block = large_buckets[i]; block; block = block->next) {
+			size_t cached = map_length(block->size);
+
+			if (cached >= length && cached - length <= length / 4 &&
+			    (!best || cached < map_length(best->size))) {
+				best = block;
+				best_index = i;
+			}
+		}
+	}
+	if (best)
+		large_unlink(best_index, best);
+	pthread_mutex_unlock(&large_mutex);
+
+	if (best) {
+		// the whole mapping stays usable, so it is unmapped in full later
+		best->size = map_length(best->size) - BLOCK_SIZE;
+		best->status = STATUS_MAPPED;
+		best->prev = NULL;
+		best->next = NULL;
+	}
+	return best;
+}
+
+// keep a freed mmap'd block for reuse, return 0 if it does not fit in the cache
+int large_cache_put(struct block_meta *block)
+{
+	size_t limit = tunable(OS_M_LARGE_CACHE);
+	size_t length = map_length(block->size);
+	size_t index = large_bucket(length);
+	struct block_meta *evicted = NULL;
+
+	if (length > limit)
+		return 0;
+
+	// the purger thread, when running, does this off the free path
+	if (!tunable(OS_M_PURGE_INTERVAL))
+		large_cache_decay(tunable(OS_M_LARGE_DECAY));
+
+	block->status = STATUS_FREE;
+	block->prev = NULL;
+	*cached_time(block) = now_ms();
+
+	pthread_mutex_lock(&large_mutex);
+	while (large_cached + length > limit) {
+		// make room by dropping the least recently cached blocks
+		struct block_meta *oldest = large_evict(-1UL);
+
+		oldest->next = evicted;
+		evicted = oldest;
+	}
+
+	block->next = large_buckets[index];
+	if (block->next)
+		block->next->prev = block;
+	else
+		large_oldest[index] = block;
+	large_buckets[index] = block;
+	large_cached += length;
+	pthread_mutex_unlock(&large_mutex);
+
+	large_release(evicted);
+	return 1;
+}
+
+// obtain the bytes of mappings in the cache
+size_t large_cache_size(void)
+{
+	pthread_mutex_lock(&large_mutex);
+	size_t cached = large_cached;
+	pthread_mutex_unlock(&large_mutex);
+
+	return cached;
+}
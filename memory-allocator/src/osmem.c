@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,125 +12,459 @@
 #include "printf.h"
 #include "osmem.h"
 #include "block_meta.h"
-#define MMAP_THRESHOLD (128 * 1024)
-#define N_ALIGN_N 8
-#define ALIGN_8BYTE(size) ((size + 7) & (~7))
-#define BLOCK_SIZE sizeof(struct block_meta)
+#include "heap.h"
 #define MAP_ANONYMOUS 0x20
 #define PAGE_SIZE 4080
+#define MIN_LINKED_SIZE sizeof(struct free_links)
+#define BIN_SEARCH_LIMIT 32
+#define PURGE_BATCH 16
+#define BATCH_RUN_SIZE MMAP_THRESHOLD
+
+// links of a free block, kept at the start of its payload
+// (8 byte blocks only have room for next_free, so their bin is singly linked)
+struct free_links {
+	struct block_meta *next_free;
+	struct block_meta *prev_free;
+};
+
+// obtain the free list links of a block
+static inline struct free_links *block_links(struct block_meta *block)
+{
+	return (struct free_links *)(block + 1);
+}
+
+// purge state of a free block of a power of two bin, kept after its links
+struct free_stamp {
+	unsigned long time;	/* purge_clock when its pages became dirty or muzzy */
+	unsigned long state;
+};
+
+#define PAGES_DIRTY 0
+#define PAGES_MUZZY 1
+#define PAGES_CLEAN 2
+
+// obtain the purge state of a block
+static inline struct free_stamp *block_stamp(struct block_meta *block)
+{
+	return (struct free_stamp *)(block_links(block) + 1);
+}
+
+// obtain the bin of a payload size: one per 8 bytes below 1 KiB, then one per power of two
+static inline size_t bin_index(size_t size)
+{
+	if (size < NUM_EXACT_BINS * N_ALIGN_N)
+		return size / N_ALIGN_N;
+
+	size_t index = NUM_EXACT_BINS + (63 - __builtin_clzl(size)) - 10;
+
+	return index < NUM_BINS ? index : NUM_BINS - 1;
+}
+
+// add a free block to its bin
+static void bin_insert(struct arena *arena, struct block_meta *block)
+{
+	size_t index = bin_index(block->size);
+	struct free_links *links = block_links(block);
+
+	links->next_free = arena->bins[index];
+	if (block->size >= MIN_LINKED_SIZE) {
+		links->prev_free = NULL;
+		if (arena->bins[index])
+			block_links(arena->bins[index])->prev_free = block;
+	}
+	arena->bins[index] = block;
+	arena->bin_map[index / 64] |= 1UL << (index % 64);
 
-struct block_meta *global_base;
-struct block_meta *large_alloc;
+	if (index >= NUM_EXACT_BINS) {
+		block_stamp(block)->time = __atomic_load_n(&purge_clock, __ATOMIC_RELAXED);
+		block_stamp(block)->state = PAGES_DIRTY;
+	}
+}
+
+// obtain the start of the whole pages of a free block that its stamp says are zero
+static inline char *zero_start(struct block_meta *block)
+{
+	return (char *)(((uintptr_t)(block_stamp(block) + 1) + MAP_PAGE - 1) & ~(MAP_PAGE - 1));
+}
+
+// obtain the end of those pages
+static inline char *zero_end(struct block_meta *block)
+{
+	return (char *)(((uintptr_t)(block + 1) + block->size) & ~(MAP_PAGE - 1));
+}
+
+// check if the whole pages of a free block past its stamp are known to be zero
+static inline int block_clean(struct block_meta *block)
+{
+	return bin_index(block->size) >= NUM_EXACT_BINS && block_stamp(block)->state == PAGES_CLEAN;
+}
+
+// add a free block of fresh or released pages to its bin
+static void bin_insert_clean(struct arena *arena, struct block_meta *block)
+{
+	bin_insert(arena, block);
+	if (bin_index(block->size) >= NUM_EXACT_BINS)
+		block_stamp(block)->state = PAGES_CLEAN;
+}
+
+// remove a free block from its bin
+static void bin_remove(struct arena *arena, struct block_meta *block)
+{
+	size_t index = bin_index(block->size);
+	struct free_links *links = block_links(block);
+
+	if (block->size < MIN_LINKED_SIZE) {
+		struct block_meta **current = &arena->bins[index];
+
+		while (*current != block)
+			current = &block_links(*current)->next_free;
+		*current = links->next_free;
+	} else {
+		if (links->prev_free)
+			block_links(links->prev_free)->next_free = links->next_free;
+		else
+			arena->bins[index] = links->next_free;
+		if (links->next_free)
+			block_links(links->next_free)->prev_free = links->prev_free;
+	}
+
+	if (!arena->bins[index])
+		arena->bin_map[index / 64] &= ~(1UL << (index % 64));
+}
+
+// obtain the first non-empty bin starting from index
+static size_t next_bin(struct arena *arena, size_t index)
+{
+	while (index < NUM_BINS) {
+		uint64_t word = arena->bin_map[index / 64] & (~0UL << (index % 64));
+
+		if (word)
+			return (index & ~63UL) + __builtin_ctzl(word);
+		index = (index & ~63UL) + 64;
+	}
+	return NUM_BINS;
+}
+
+// bounds of the sbrk heap, which os_free_sized() checks instead of the page map
+static uintptr_t sbrk_floor, sbrk_top;
+
+// tell whether ptr lies in the sbrk heap, i.e. in arena 0 outside any segment
+static inline int in_sbrk_heap(const void *ptr)
+{
+	uintptr_t top = __atomic_load_n(&sbrk_top, __ATOMIC_ACQUIRE);
+
+	return (uintptr_t)ptr >= __atomic_load_n(&sbrk_floor, __ATOMIC_RELAXED) && (uintptr_t)ptr < top;
+}
+
+// grow the sbrk heap, adding the new pages to the page map
+static void *heap_sbrk(size_t size)
+{
+	// a larger increment would move the break down
+	if (size > INTPTR_MAX) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+
+	void *old_end = sys_sbrk(size);
+
+	if (old_end == (void *)-1)
+		return old_end;
+
+	if (page_map_set(old_end, size, &arenas[0].span)) {
+		sys_sbrk(-size);
+		return (void *)-1;
+	}
+	if (!sbrk_floor)
+		__atomic_store_n(&sbrk_floor, (uintptr_t)old_end, __ATOMIC_RELAXED);
+	__atomic_store_n(&sbrk_top, (uintptr_t)old_end + size, __ATOMIC_RELEASE);
+	return old_end;
+}
+
+// obtain the first block of memory heap_sbrk() returned, aligned in case
+// something else left the break unaligned
+static inline struct block_meta *heap_block(char *heap)
+{
+	return (struct block_meta *)(((uintptr_t)heap + N_ALIGN_N - 1) & ~(uintptr_t)(N_ALIGN_N - 1));
+}
 
 // init heap
-void init_heap(void)
+static void init_heap(struct arena *arena)
 {
-	if (!global_base) {
-		global_base = sbrk(0);
-		void *heap_end = sbrk(MMAP_THRESHOLD);
+	if (!arena->base) {
+		arena->span.arena = arena;
+		arena->span.kind = SPAN_HEAP;
 
-		if (heap_end == (void *)-1)
+		char *heap = heap_sbrk(MMAP_THRESHOLD);
+
+		if (heap == (void *)-1)
 			return;
-		struct block_meta *first_block = global_base;
+		arena->base = heap_block(heap);
+		struct block_meta *first_block = arena->base;
 
-		first_block->size = MMAP_THRESHOLD - BLOCK_SIZE;
+		first_block->size = (heap + MMAP_THRESHOLD - (char *)(first_block + 1)) & ~(size_t)(N_ALIGN_N - 1);
 		first_block->status = STATUS_FREE;
 		first_block->next = NULL;
 		first_block->prev = NULL;
+		arena->last = first_block;
+		bin_insert_clean(arena, first_block);
+	}
+}
+
+// obtain the best fitting block among the first entries of a bin, the lowest one on ties
+static struct block_meta *best_in_bin(struct arena *arena, size_t index, size_t size)
+{
+	struct block_meta *best = NULL;
+	struct block_meta *current = arena->bins[index];
+
+	for (int i = 0; current && i < BIN_SEARCH_LIMIT; i++) {
+		if (current->size >= size &&
+		    (!best || current->size < best->size || (current->size == best->size && current < best)))
+			best = current;
+		current = block_links(current)->next_free;
 	}
+	return best;
 }
 
 // obtain a free block
-struct block_meta *get_free_block(size_t size)
+static struct block_meta *get_free_block(struct arena *arena, size_t size)
 {
-	struct block_meta *current = global_base;
+	size_t index = bin_index(size);
+
+	if (index >= NUM_EXACT_BINS) {
+		// a power of two bin also holds blocks smaller than the request
+		struct block_meta *best = best_in_bin(arena, index, size);
 
-	while (current) {
-		if (current->status == STATUS_FREE && current->size >= size)
-			return current;
-		current = current->next;
+		if (best)
+			return best;
+		index++;
 	}
-	return NULL;
+
+	index = next_bin(arena, index);
+	if (index == NUM_BINS)
+		return NULL;
+
+	return best_in_bin(arena, index, size);
 }
 
-// obtain the last block from the sbrk list
-struct block_meta *get_last_block(void)
+// check if a block lies right before the next one in its list
+static inline int next_is_adjacent(struct block_meta *block)
 {
-	if (!global_base)
-		return NULL;
+	return (char *)(block + 1) + block->size == (char *)block->next;
+}
+
+// absorb the next block of the list into block
+static void absorb_next(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *next = block->next;
+
+	block->size += next->size + BLOCK_SIZE;
+	block->next = next->next;
+	if (block->next)
+		block->next->prev = block;
+	if (arena->last == next)
+		arena->last = block;
+}
+
+// map a new segment for an mmap backed arena, as one free block
+static void map_segment(struct arena *arena)
+{
+	struct block_meta *block = sys_mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+					    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (block == MAP_FAILED)
+		return;
+
+	arena->span.arena = arena;
+	arena->span.kind = SPAN_HEAP;
+	if (page_map_set(block, SEGMENT_SIZE, &arena->span)) {
+		sys_munmap(block, SEGMENT_SIZE);
+		return;
+	}
+
+	block->size = SEGMENT_SIZE - BLOCK_SIZE;
+	block->status = STATUS_FREE;
+	block->prev = NULL;
+	block->next = NULL;
+	arena->segments++;
+	bin_insert_clean(arena, block);
+}
+
+// the next step of the sbrk heap, with OS_M_HEAP_GROWTH set
+static size_t heap_step = MMAP_THRESHOLD;
+
+// obtain the bytes to grow the sbrk heap by when it lacks size bytes: exactly
+// those, or with OS_M_HEAP_GROWTH set at least a step that doubles at each
+// growth up to it; called with arena 0 locked
+static size_t heap_growth(size_t size)
+{
+	size_t max = tunable(OS_M_HEAP_GROWTH);
 
-	struct block_meta *current = global_base;
+	if (!max)
+		return size;
 
-	while (current->next)
-		current = current->next;
+	if (heap_step < max)
+		heap_step = heap_step * 2 < max ? heap_step * 2 : max;
+	if (size < heap_step)
+		return heap_step;
+	return (size + MAP_PAGE - 1) & ~(MAP_PAGE - 1);
+}
+
+// add the size bytes heap_sbrk() returned at heap as a free last block of the sbrk heap
+static void heap_append(struct arena *arena, char *heap, size_t size)
+{
+	struct block_meta *new_block = heap_block(heap);
+	struct block_meta *last = arena->last;
 
+	// too little to hold a block, left unused
+	if ((char *)(new_block + 1) + N_ALIGN_N > heap + size)
+		return;
 
-	return current;
+	new_block->size = (heap + size - (char *)(new_block + 1)) & ~(size_t)(N_ALIGN_N - 1);
+	new_block->status = STATUS_FREE;
+	new_block->prev = last;
+	new_block->next = NULL;
+
+	if (last)
+		last->next = new_block;
+	else
+		arena->base = new_block;
+	arena->last = new_block;
+	bin_insert_clean(arena, new_block);
 }
 
 // expand the heap
-void expand_heap(size_t size)
+static void expand_heap(struct arena *arena, size_t size)
 {
-	struct block_meta *last = global_base;
+	if (arena != &arenas[0]) {
+		// a raised mmap threshold may send blocks no segment holds
+		if (size <= SEGMENT_SIZE - BLOCK_SIZE)
+			map_segment(arena);
+		return;
+	}
 
-	while (last && last->next)
-		last = last->next;
+	struct block_meta *last = arena->last;
+	char *last_end = (char *)(last + 1) + last->size;
+	int extend = last->status == STATUS_FREE && last->size < size && sbrk(0) == last_end;
+	size_t total_size = heap_growth(extend ? size - last->size : size + BLOCK_SIZE);
 
-	if (last->status == STATUS_FREE && last->size < size) {
-		// expand is last block free but little size
-		size_t total_size = size - last->size;
+	// the break may move between the two calls, so the new memory is
+	// where heap_sbrk() says, the page map covering just that
+	char *heap = heap_sbrk(total_size);
 
-		void *heap_end = sbrk(total_size);
+	if (heap == (void *)-1)
+		return;
 
-		if (heap_end == (void *)-1)
-			return;
+	if (extend && heap == last_end) {
+		// expand is last block free but little size
+		// memory past the break is zero, and so are the new pages if
+		// nothing of last lies past the page of its stamp
+		int clean = zero_start(last) >= (char *)(last + 1) + last->size;
 
+		bin_remove(arena, last);
 		last->size += total_size;
+		if (clean)
+			bin_insert_clean(arena, last);
+		else
+			bin_insert(arena, last);
 	} else {
-		size_t total_size = size + BLOCK_SIZE;
+		heap_append(arena, heap, total_size);
+	}
+}
 
-		void *heap = sbrk(0);
+// coalesce an unbinned free block with its free neighbours from the list
+static struct block_meta *coalesce_block(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *next = block->next;
+	struct block_meta *prev = block->prev;
 
-		if (heap == (void *)-1)
-			return;
+	if (next && next->status == STATUS_FREE && next_is_adjacent(block)) {
+		bin_remove(arena, next);
+		absorb_next(arena, block);
+	}
 
-		void *heap_end = sbrk(total_size);
+	if (prev && prev->status == STATUS_FREE && next_is_adjacent(prev)) {
+		bin_remove(arena, prev);
+		absorb_next(arena, prev);
+		block = prev;
+	}
 
-		if (heap_end == (void *)-1)
-			return;
+	return block;
+}
 
-		struct block_meta *new_block = heap;
+// return the whole pages between start and end to the system, return their number
+static size_t purge_pages(char *start, char *end, int advice)
+{
+	start = (char *)(((uintptr_t)start + MAP_PAGE - 1) & ~(MAP_PAGE - 1));
+	end = (char *)((uintptr_t)end & ~(MAP_PAGE - 1));
 
-		new_block->size = size;
-		new_block->status = STATUS_FREE;
-		new_block->prev = last;
-		new_block->next = NULL;
+	if (start >= end || sys_madvise(start, end - start, advice))
+		return 0;
+	return (end - start) >> PAGE_SHIFT;
+}
 
-		if (last)
-			last->next = new_block;
-		else
-			global_base = new_block;
-	}
+// shrink the sbrk heap down to the first page of its free last block
+static int trim_heap(struct arena *arena, struct block_meta *block)
+{
+	char *end = (char *)(block + 1) + block->size;
+	char *new_end = (char *)(((uintptr_t)(block_stamp(block) + 1) + MAP_PAGE - 1) & ~(MAP_PAGE - 1));
+
+	if (arena != &arenas[0] || block != arena->last || new_end >= end || sbrk(0) != end)
+		return 0;
+
+	if (sys_sbrk(new_end - end) == (void *)-1)
+		return 0;
+
+	page_map_set(new_end, end - new_end, NULL);
+	__atomic_store_n(&sbrk_top, (uintptr_t)new_end, __ATOMIC_RELEASE);
+	block->size = new_end - (char *)(block + 1);
+	// a heap that shrinks grows back in small steps again
+	heap_step = MMAP_THRESHOLD;
+	return 1;
 }
 
-// coalesce free blocks from the sbrk list
-void coalesce_blocks(void)
+// give a free block back to the bins, or its whole segment back to the system
+static void release_block(struct arena *arena, struct block_meta *block)
 {
-	struct block_meta *current = global_base;
+	int threshold = tunable(OS_M_TRIM_THRESHOLD);
+	struct block_meta *next = block->next;
+	struct block_meta *prev = block->prev;
+	char *start = (char *)block;
+	char *end = (char *)(block + 1) + block->size;
+
+	// free neighbours below the threshold still have all their pages, the
+	// others still have the pages they share with block
+	if (next && next->status == STATUS_FREE && next_is_adjacent(block))
+		end = next->size < (size_t)threshold ? (char *)(next + 1) + next->size :
+		      (char *)(block_stamp(next) + 1) + MAP_PAGE;
+	if (prev && prev->status == STATUS_FREE && next_is_adjacent(prev))
+		start = prev->size < (size_t)threshold ? (char *)prev : (char *)block - MAP_PAGE;
+
+	block = coalesce_block(arena, block);
+
+	if (arena != &arenas[0] && !block->prev && !block->next && arena->segments > 1) {
+		// keep one empty segment around, unmap the others
+		arena->segments--;
+		page_map_set(block, SEGMENT_SIZE, NULL);
+		sys_munmap(block, SEGMENT_SIZE);
+		return;
+	}
 
-	while (current) {
-		if (current->status == STATUS_FREE && current->next && current->next->status == STATUS_FREE) {
-			current->size += current->next->size + BLOCK_SIZE;
-			current->next = current->next->next;
-			if (current->next)
-				current->next->prev = current;
-		}
-		current = current->next;
+	// the purger thread, when running, does this off the free path
+	if (threshold >= 0 && block->size >= (size_t)threshold && !tunable(OS_M_PURGE_INTERVAL) &&
+	    !trim_heap(arena, block)) {
+		// large free blocks keep their header, links and stamp resident only
+		char *stamp_end = (char *)(block_stamp(block) + 1);
+		char *block_end = (char *)(block + 1) + block->size;
+
+		purge_pages(start > stamp_end ? start : stamp_end, end < block_end ? end : block_end,
+			    tunable(OS_M_MADV_FREE) ? MADV_FREE : MADV_DONTNEED);
 	}
+
+	bin_insert(arena, block);
 }
 
 // split a block
-void split_block(struct block_meta *block, size_t size)
+static void split_block(struct arena *arena, struct block_meta *block, size_t size)
 {
 	if (block->size >= size) {
 		size_t remaining_space = block->size - size;
@@ -148,295 +483,989 @@ void split_block(struct block_meta *block, size_t size)
 
 			if (new_block->next)
 				new_block->next->prev = new_block;
+			if (arena->last == block)
+				arena->last = new_block;
+			bin_insert(arena, coalesce_block(arena, new_block));
 		}
 	}
 }
 
-// search a block from the sbrk list
-void *search_block_sbrk(struct block_meta *block)
+// bin the block left behind by the last moved realloc
+static void flush_deferred_block(struct arena *arena)
+{
+	if (!arena->deferred)
+		return;
+
+	release_block(arena, arena->deferred);
+	arena->deferred = NULL;
+}
+
+// take a free block for an allocation of size bytes
+static void use_block(struct arena *arena, struct block_meta *block, size_t size)
+{
+	int clean = block_clean(block);
+
+	bin_remove(arena, block);
+	block->status = STATUS_ALLOC;
+	split_block(arena, block, size);
+
+	// the rest split off keeps the zero pages it had as part of block
+	if (clean && block->next && block->next->status == STATUS_FREE && next_is_adjacent(block) &&
+	    bin_index(block->next->size) >= NUM_EXACT_BINS)
+		block_stamp(block->next)->state = PAGES_CLEAN;
+}
+
+// obtain a free block of at least size bytes, growing the arena if there is none
+static struct block_meta *find_block(struct arena *arena, size_t size)
+{
+	flush_deferred_block(arena);
+	remote_drain(arena);
+	if (arena == &arenas[0]) {
+		init_heap(arena);
+		if (!arena->base)
+			return NULL;
+	}
+
+	struct block_meta *best = get_free_block(arena, size);
+
+	if (!best) {
+		expand_heap(arena, size);
+		best = get_free_block(arena, size);
+	}
+	return best;
+}
+
+// allocate size bytes from an arena
+void *heap_malloc(struct arena *arena, size_t size)
+{
+	struct block_meta *best = find_block(arena, size);
+
+	if (!best)
+		return NULL;
+
+	use_block(arena, best, size);
+	return (void *)(best + 1);
+}
+
+// allocate size zeroed bytes from an arena, clearing only what is not known to be zero
+static void *heap_calloc(struct arena *arena, size_t size)
 {
-	if (!block)
+	struct block_meta *best = find_block(arena, size);
+
+	if (!best)
 		return NULL;
 
-	struct block_meta *current = global_base;
+	char *payload = (char *)(best + 1);
+	char *start = block_clean(best) ? zero_start(best) : payload + size;
+	char *end = block_clean(best) ? zero_end(best) : payload + size;
 
-	while (current) {
-		if (current == block)
-			return current;
-		current = current->next;
+	use_block(arena, best, size);
+	if (start >= end || start >= payload + size) {
+		memset(payload, 0, size);
+	} else {
+		memset(payload, 0, start - payload);
+		if (end < payload + size)
+			memset(end, 0, payload + size - end);
 	}
-	return NULL;
+	return payload;
 }
 
-// coalesce free blocks from the mmap list
-void coalesce_mmap(void)
+// allocate count blocks of size bytes, carved out of one free block when possible
+size_t heap_malloc_run(struct arena *arena, size_t size, size_t count, void **ptrs)
 {
-	struct block_meta *current = large_alloc;
+	size_t total = count * (size + BLOCK_SIZE) - BLOCK_SIZE;
+
+	flush_deferred_block(arena);
+	remote_drain(arena);
+	if (arena == &arenas[0]) {
+		init_heap(arena);
+		if (!arena->base)
+			return 0;
+	}
+
+	struct block_meta *block = get_free_block(arena, total);
 
-	while (current) {
-		if (current->status == STATUS_FREE && current->next && current->next->status == STATUS_FREE) {
-			current->size += current->next->size + BLOCK_SIZE;
-			current->next = current->next->next;
-			if (current->next)
-				current->next->prev = current;
+	if (!block) {
+		expand_heap(arena, total);
+		block = get_free_block(arena, total);
+		if (!block) {
+			ptrs[0] = heap_malloc(arena, size);
+			return ptrs[0] != NULL;
 		}
-		current = current->next;
 	}
+
+	use_block(arena, block, total);
+	for (size_t i = 0; i < count; i++) {
+		ptrs[i] = block + 1;
+		if (i + 1 == count)
+			break;
+
+		struct block_meta *next = (struct block_meta *)((char *)(block + 1) + size);
+
+		next->size = block->size - size - BLOCK_SIZE;
+		next->status = STATUS_ALLOC;
+		next->prev = block;
+		next->next = block->next;
+		if (next->next)
+			next->next->prev = next;
+		if (arena->last == block)
+			arena->last = next;
+
+		block->size = size;
+		block->next = next;
+		block = next;
+	}
+	return count;
 }
 
-void *os_malloc(size_t size)
+// give a heap block back to its arena
+void heap_free(struct arena *arena, struct block_meta *block)
 {
-	/* TODO: Implement os_malloc */
-	size_t new_size = ALIGN_8BYTE(size);
+	// the deferred block must be binned before a neighbour coalesces with it
+	flush_deferred_block(arena);
+	block->status = STATUS_FREE;
+	release_block(arena, block);
+}
 
-	if (size == 0)
-		return NULL;
+// obtain the state the pages of a free block decay to by now, force skipping the decay times
+static unsigned long decayed_state(struct block_meta *block, unsigned long now, int force)
+{
+	struct free_stamp *stamp = block_stamp(block);
+	unsigned long age = now - stamp->time;
+	unsigned long muzzy_decay = tunable(OS_M_MUZZY_DECAY);
+
+	if (stamp->state == PAGES_DIRTY && (force || age >= (unsigned long)tunable(OS_M_DIRTY_DECAY)))
+		return muzzy_decay && !force ? PAGES_MUZZY : PAGES_CLEAN;
+	if (stamp->state == PAGES_MUZZY && (force || age >= muzzy_decay))
+		return PAGES_CLEAN;
+	return stamp->state;
+}
+
+// give back the pages of the free blocks of an arena that decayed by now,
+// taking them out of the bins so the arena stays unlocked during madvise
+void heap_purge(struct arena *arena, unsigned long now, int force, struct os_purge_stats *stats)
+{
+	struct block_meta *batch[PURGE_BATCH];
+	unsigned long states[PURGE_BATCH];
+	size_t count;
+	int failed = 0;
+
+	do {
+		count = 0;
+		arena_lock(arena);
+		flush_deferred_block(arena);
+		remote_drain(arena);
+		for (size_t index = next_bin(arena, NUM_EXACT_BINS); index < NUM_BINS && count < PURGE_BATCH;
+		     index = next_bin(arena, index + 1)) {
+			struct block_meta *block = arena->bins[index];
+
+			while (block && count < PURGE_BATCH) {
+				struct block_meta *next = block_links(block)->next_free;
+				unsigned long state = decayed_state(block, now, force);
+				size_t size = block->size;
+
+				if (state == block_stamp(block)->state ||
+				    (char *)(block_stamp(block) + 1) + MAP_PAGE > (char *)(block + 1) + size) {
+					block = next;
+					continue;
+				}
+
+				bin_remove(arena, block);
+				if (state == PAGES_CLEAN && trim_heap(arena, block)) {
+					stats->pages_trimmed += (size - block->size) >> PAGE_SHIFT;
+					bin_insert(arena, block);
+					block_stamp(block)->state = PAGES_CLEAN;
+				} else {
+					// kept out of reach of allocations and coalescing
+					block->status = STATUS_CACHED;
+					batch[count] = block;
+					states[count++] = state;
+				}
+				block = next;
+			}
+		}
+		arena_unlock(arena);
+
+		for (size_t i = 0; i < count; i++) {
+			struct block_meta *block = batch[i];
+			char *start = (char *)(block_stamp(block) + 1);
+			char *end = (char *)(block + 1) + block->size;
 
-	if (new_size < MMAP_THRESHOLD - BLOCK_SIZE) {
-		init_heap();
+			size_t pages;
 
-		struct block_meta *best = get_free_block(new_size);
+			if (states[i] == PAGES_MUZZY) {
+				pages = purge_pages(start, end, MADV_FREE);
+				stats->pages_muzzy += pages;
+			} else {
+				pages = purge_pages(start, end, MADV_DONTNEED);
+				stats->pages_purged += pages;
+			}
+			// pages madvise failed on stay dirty, and are not tried again before they decay
+			if (!pages) {
+				states[i] = PAGES_DIRTY;
+				failed = 1;
+			}
+		}
+
+		arena_lock(arena);
+		// coalescing must not meet a block left behind by realloc meanwhile
+		flush_deferred_block(arena);
+		for (size_t i = 0; i < count; i++) {
+			struct block_meta *block = batch[i];
+			size_t size = block->size;
+			struct block_meta *merged;
+
+			block->status = STATUS_FREE;
+			merged = coalesce_block(arena, block);
+			bin_insert(arena, merged);
+			// neighbours freed meanwhile leave the merged block dirty
+			if (merged == block && block->size == size) {
+				block_stamp(block)->time = now;
+				block_stamp(block)->state = states[i];
+			}
+		}
+		arena_unlock(arena);
+	} while (count == PURGE_BATCH && !failed);
+}
 
-		if (best) {
-			best->status = STATUS_ALLOC;
-			split_block(best, new_size);
-			coalesce_blocks();
-			return (void *)(best + 1);
+// map a block backed by huge pages: MAP_HUGETLB ones if asked for and there are any,
+// otherwise transparent ones over a mapping aligned to HUGE_PAGE
+static struct block_meta *map_huge(size_t size, int flags)
+{
+	size_t length = (size + BLOCK_SIZE + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	struct block_meta *block;
+
+	if (flags & OS_MALLOC_HUGETLB) {
+		block = sys_mmap(NULL, length, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED) {
+			block->status = STATUS_HUGETLB;
+			goto out;
 		}
+	}
+
+	// map one huge page more and cut the unaligned ends off
+	char *area = sys_mmap(NULL, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (area == MAP_FAILED)
+		return NULL;
+
+	char *start = (char *)(((uintptr_t)area + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+
+	if (start > area)
+		sys_munmap(area, start - area);
+	sys_munmap(start + length, area + HUGE_PAGE - start);
+	sys_madvise(start, length, MADV_HUGEPAGE);
 
-		expand_heap(new_size);
+	block = (struct block_meta *)start;
+	block->status = STATUS_MAPPED;
+out:
+	// the whole mapping is usable, and unmapped in full later
+	block->size = length - BLOCK_SIZE;
+	block->prev = NULL;
+	block->next = NULL;
+	return block;
+}
+
+// allocate a block of size bytes with mmap, with the OS_MALLOC_* flags
+void *map_block(size_t size, int flags)
+{
+	int huge = tunable(OS_M_HUGEPAGE);
+
+	// the tunable only turns mappings of huge pages or more to huge pages
+	if (huge && size + BLOCK_SIZE >= HUGE_PAGE)
+		flags |= huge == 2 ? OS_MALLOC_HUGETLB : OS_MALLOC_HUGEPAGE;
+
+	if (flags & (OS_MALLOC_HUGEPAGE | OS_MALLOC_HUGETLB)) {
+		struct block_meta *block = map_huge(size, flags);
 
-		best = get_free_block(new_size);
-		if (best) {
-			best->status = STATUS_ALLOC;
-			split_block(best, new_size);
-			coalesce_blocks();
-			return (void *)(best + 1);
+		if (!block)
+			return NULL;
+		count_mapped(block->size, 1);
+		return (void *)(block + 1);
+	}
+
+	if (tunable(OS_M_LARGE_CACHE)) {
+		struct block_meta *cached = large_cache_get(size);
+
+		if (cached) {
+			// fresh mappings are zero already, reused ones are not
+			if (flags & OS_MALLOC_ZERO)
+				memset(cached + 1, 0, size);
+			count_mapped(cached->size, 1);
+			return (void *)(cached + 1);
 		}
 	}
-	// mmap allocation
-	void *block = mmap(NULL, new_size + BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	void *block = sys_mmap(NULL, size + BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
 	if (block == MAP_FAILED)
 		return NULL;
 
 	struct block_meta *new_block = block;
 
-	new_block->size = new_size;
+	new_block->size = size;
 	new_block->status = STATUS_MAPPED;
 	new_block->prev = NULL;
-	new_block->next = large_alloc;
-	if (large_alloc)
-		large_alloc->prev = new_block;
-
-	large_alloc = new_block;
-	coalesce_mmap();
+	new_block->next = NULL;
+	count_mapped(size, 1);
 	return (void *)(new_block + 1);
 }
 
+// check if a mapped block starts its mapping, which aligned ones may not
+static inline int starts_mapping(struct block_meta *block)
+{
+	return !((uintptr_t)block & (MAP_PAGE - 1));
+}
+
+// map a block of size bytes with its payload aligned to align, a power of two above 32;
+// the header goes right before the payload and the pages before its own are unmapped
+void *map_aligned(size_t size, size_t align)
+{
+	size_t length = map_length(size + align);
+	char *area = sys_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (area == MAP_FAILED)
+		return NULL;
+
+	char *payload = (char *)(((uintptr_t)area + BLOCK_SIZE + align - 1) & ~(align - 1));
+	struct block_meta *block = (struct block_meta *)payload - 1;
+	char *start = (char *)((uintptr_t)block & ~(MAP_PAGE - 1));
+	char *end = (char *)(((uintptr_t)payload + size + MAP_PAGE - 1) & ~(MAP_PAGE - 1));
+
+	if (start > area)
+		sys_munmap(area, start - area);
+	if (end < area + length)
+		sys_munmap(end, area + length - end);
+
+	block->size = end - payload;
+	block->status = STATUS_MAPPED;
+	block->prev = NULL;
+	block->next = NULL;
+	count_mapped(block->size, 1);
+	return payload;
+}
+
+// release a block allocated with mmap
+static void unmap_block(struct block_meta *block)
+{
+	count_mapped(-(long)block->size, -1);
+
+	// blocks of this size are freed, so their next ones come from the heap,
+	// unless they are too large for that to pay; free heap blocks that size
+	// are then kept rather than given back, as in glibc
+	if (tunable(OS_M_MMAP_DYNAMIC) && block->status == STATUS_MAPPED &&
+	    block->size + BLOCK_SIZE < MMAP_THRESHOLD_MAX) {
+		int threshold = block->size + BLOCK_SIZE + N_ALIGN_N;
+
+		tunable_raise(OS_M_MMAP_THRESHOLD, threshold);
+		if (tunable(OS_M_TRIM_THRESHOLD) >= 0)
+			tunable_raise(OS_M_TRIM_THRESHOLD, 2 * threshold);
+	}
+
+	// the profiler keeps the pages of small samples for the next ones
+	if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) && prof_free(block))
+		return;
+
+	// huge pages of MAP_HUGETLB are not worth keeping from their pool,
+	// and the cache only takes blocks that start their mapping
+	if (block->status != STATUS_HUGETLB && starts_mapping(block) && large_cache_put(block))
+		return;
+
+	char *start = (char *)((uintptr_t)block & ~(MAP_PAGE - 1));
+
+	block->status = STATUS_FREE;
+	sys_munmap(start, (char *)(block + 1) + block->size - start);
+}
+
+void *os_malloc(size_t size)
+{
+	return os_malloc_flags(size, 0);
+}
+
+// allocate size bytes with the OS_MALLOC_* flags, behind os_malloc_flags()
+// and the other public calls, which are traced
+void *do_malloc(size_t size, int flags)
+{
+	size_t new_size = ALIGN_SIZE(size);
+	struct arena *arena = thread_arena();
+
+	if (size == 0)
+		return NULL;
+	if (size > MAX_ALLOC_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (tunable(OS_M_PROF_SAMPLE) && prof_tick(new_size)) {
+		void *ptr = prof_malloc(new_size, 0, flags);
+
+		if (ptr)
+			return ptr;
+	}
+
+	if (new_size <= SLAB_MAX_SIZE && tunable(OS_M_SLAB)) {
+		arena_lock(arena);
+		void *ptr = slab_malloc(arena, new_size);
+
+		arena_unlock(arena);
+		if (ptr) {
+			if (flags & OS_MALLOC_ZERO)
+				memset(ptr, 0, new_size);
+			return ptr;
+		}
+	}
+
+	if (new_size + BLOCK_SIZE < mmap_threshold()) {
+		void *ptr = tcache_enabled() ? tcache_get(arena, new_size) : NULL;
+
+		if (ptr) {
+			if (flags & OS_MALLOC_ZERO)
+				memset(ptr, 0, new_size);
+			return ptr;
+		}
+
+		arena_lock(arena);
+		ptr = flags & OS_MALLOC_ZERO ? heap_calloc(arena, new_size) : heap_malloc(arena, new_size);
+		arena_unlock(arena);
+		if (ptr)
+			return ptr;
+	}
+
+	return map_block(new_size, flags);
+}
+
+void *os_malloc_flags(size_t size, int flags)
+{
+	unsigned long start = trace_clock();
+	void *ptr = do_malloc(size, flags);
+
+	trace(OS_TRACE_MALLOC, start, NULL, size, ptr);
+	return ptr;
+}
+
+// allocate size bytes from an arena with the payload aligned to align, a power of two;
+// the slack before the aligned payload goes back to the bins as a free block
+static void *heap_memalign(struct arena *arena, size_t size, size_t align)
+{
+	char *ptr = heap_malloc(arena, size + align + BLOCK_SIZE);
+
+	if (!ptr)
+		return NULL;
+	// aligned already: the slack goes back at the end instead
+	if (!((uintptr_t)ptr & (align - 1))) {
+		split_block(arena, (struct block_meta *)ptr - 1, size);
+		return ptr;
+	}
+
+	// the slack must be large enough to hold a block
+	char *payload = (char *)(((uintptr_t)ptr + BLOCK_SIZE + N_ALIGN_N + align - 1) & ~(align - 1));
+	struct block_meta *block = (struct block_meta *)ptr - 1;
+	struct block_meta *aligned = (struct block_meta *)payload - 1;
+
+	aligned->size = ptr + block->size - payload;
+	aligned->status = STATUS_ALLOC;
+	aligned->prev = block;
+	aligned->next = block->next;
+	if (aligned->next)
+		aligned->next->prev = aligned;
+	if (arena->last == block)
+		arena->last = aligned;
+
+	block->size = (char *)aligned - ptr;
+	block->next = aligned;
+	block->status = STATUS_FREE;
+	release_block(arena, block);
+
+	split_block(arena, aligned, size);
+	return payload;
+}
+
+static void *do_memalign(size_t align, size_t size)
+{
+	if (align & (align - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t new_size = ALIGN_SIZE(size);
+
+	if (align <= N_ALIGN_N || !size)
+		return do_malloc(size, 0);
+	// the payload, the slack to align it and the headers must not wrap
+	if (size > MAX_ALLOC_SIZE || align > MAX_ALLOC_SIZE - size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (tunable(OS_M_PROF_SAMPLE) && prof_tick(new_size)) {
+		void *ptr = prof_malloc(new_size, align > BLOCK_SIZE ? align : 0, 0);
+
+		if (ptr)
+			return ptr;
+	}
+
+	if (new_size + align + 2 * BLOCK_SIZE < mmap_threshold()) {
+		struct arena *arena = thread_arena();
+
+		arena_lock(arena);
+		void *ptr = heap_memalign(arena, new_size, align);
+
+		arena_unlock(arena);
+		if (ptr)
+			return ptr;
+	}
+
+	// payloads of mapped blocks are 32 byte aligned already
+	if (align <= BLOCK_SIZE)
+		return map_block(new_size, 0);
+	return map_aligned(new_size, align);
+}
+
+void *os_memalign(size_t align, size_t size)
+{
+	unsigned long start = trace_clock();
+	void *ptr = do_memalign(align, size);
+
+	trace(OS_TRACE_MEMALIGN, start, (void *)align, size, ptr);
+	return ptr;
+}
+
+void *os_aligned_alloc(size_t align, size_t size)
+{
+	return os_memalign(align, size);
+}
+
+int os_posix_memalign(void **memptr, size_t align, size_t size)
+{
+	if (!align || align % sizeof(void *) || (align & (align - 1)))
+		return EINVAL;
+
+	void *ptr = os_memalign(align, size);
+
+	if (!ptr && size)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
 // free a block
-void os_free(void *ptr)
+void do_free(void *ptr)
 {
 	if (!ptr)
 		return; // NULL
 
-	struct block_meta *block = ptr - 32; // Point to the metadata
+	purge_start();
+
+	struct span *span = page_span(ptr);
 
-	if (block->status == STATUS_FREE) {
-		(void)ptr;
+	if (span && span->kind == SPAN_SLAB) {
+		if (!remote_free(span, ptr))
+			slab_free(span, ptr);
 		return;
 	}
 
-	struct block_meta *last_block = get_last_block();
+	struct block_meta *block = (struct block_meta *)ptr - 1;
+
+	if (block->status == STATUS_FREE || block->status == STATUS_CACHED)
+		return;
 
-	if (block >= global_base && block <= last_block) {
+	if (span) {
 		// the block is from heap allocation
-		block->status = STATUS_FREE;
-		coalesce_blocks();
+		if (tcache_enabled() && tcache_put(block))
+			return;
+		if (remote_free(span, ptr))
+			return;
+
+		struct arena *arena = span->arena;
+
+		arena_lock(arena);
+		heap_free(arena, block);
+		arena_unlock(arena);
 		return;
 	}
 
 	// the block is from mmap allocation
-	if (block == large_alloc)
-		large_alloc = block->next;
-	if (block->prev)
-		block->prev->next = block->next;
-	if (block->next)
-		block->next->prev = block->prev;
+	unmap_block(block);
+}
 
-	block->status = STATUS_FREE;
-	munmap(block, block->size + BLOCK_SIZE);
+void os_free(void *ptr)
+{
+	unsigned long start = trace_clock();
+
+	do_free(ptr);
+	trace(OS_TRACE_FREE, start, ptr, 0, NULL);
 }
 
+// free a block of size bytes, looking at its header instead of the page map,
+// which only blocks of the segments still need for their arena
+static void do_free_sized(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	// slots have no header to look at, once there are slabs
+	if (ALIGN_SIZE(size) <= SLAB_MAX_SIZE && __atomic_load_n(&slab_zone, __ATOMIC_RELAXED)) {
+		do_free(ptr);
+		return;
+	}
 
-void *os_calloc(size_t nmemb, size_t size)
+	purge_start();
+
+	struct block_meta *block = (struct block_meta *)ptr - 1;
+
+	if (block->status == STATUS_ALLOC) {
+		if (tcache_enabled() && tcache_put(block))
+			return;
+
+		struct span *span = in_sbrk_heap(block) ? &arenas[0].span : page_span(block);
+		struct arena *arena = span->arena;
+
+		if (remote_free(span, ptr))
+			return;
+
+		arena_lock(arena);
+		heap_free(arena, block);
+		arena_unlock(arena);
+	} else if (block->status == STATUS_MAPPED || block->status == STATUS_HUGETLB) {
+		unmap_block(block);
+	}
+}
+
+void os_free_sized(void *ptr, size_t size)
+{
+	unsigned long start = trace_clock();
+
+	do_free_sized(ptr, size);
+	if (ptr)
+		trace(OS_TRACE_FREE, start, ptr, size, NULL);
+}
+
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	struct span *span = page_span(ptr);
+
+	if (span && span->kind == SPAN_SLAB)
+		return span->size_class;
+
+	struct block_meta *block = (struct block_meta *)ptr - 1;
+
+	if (block->status == STATUS_FREE || block->status == STATUS_CACHED)
+		return 0;
+	return block->size;
+}
+
+static size_t do_malloc_batch(size_t size, size_t count, void **ptrs)
+{
+	size_t new_size = ALIGN_SIZE(size);
+	size_t done = 0;
+
+	if (!size)
+		return 0;
+	if (size > MAX_ALLOC_SIZE) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	if (new_size + BLOCK_SIZE >= mmap_threshold()) {
+		while (done < count && (ptrs[done] = map_block(new_size, 0)))
+			done++;
+		return done;
+	}
+
+	struct arena *arena = thread_arena();
+
+	arena_lock(arena);
+	if (new_size <= SLAB_MAX_SIZE && tunable(OS_M_SLAB))
+		while (done < count && (ptrs[done] = slab_malloc(arena, new_size)))
+			done++;
+
+	while (done < count) {
+		// runs of up to BATCH_RUN_SIZE bytes, which fit in a segment
+		size_t run = BATCH_RUN_SIZE / (new_size + BLOCK_SIZE);
+		size_t got;
+
+		if (run > count - done)
+			run = count - done;
+		got = heap_malloc_run(arena, new_size, run ? run : 1, ptrs + done);
+		if (!got)
+			break;
+		done += got;
+	}
+	arena_unlock(arena);
+
+	// as in do_malloc(), what the heaps cannot hold is mmap'd
+	while (done < count && (ptrs[done] = map_block(new_size, 0)))
+		done++;
+	return done;
+}
+
+size_t os_malloc_batch(size_t size, size_t count, void **ptrs)
+{
+	unsigned long start = trace_clock();
+	size_t done = do_malloc_batch(size, count, ptrs);
+
+	for (size_t i = 0; i < done && __atomic_load_n(&tracing, __ATOMIC_RELAXED); i++)
+		trace_record(OS_TRACE_MALLOC, start, NULL, size, ptrs[i]);
+	return done;
+}
+
+void os_free_batch(void **ptrs, size_t count)
+{
+	struct arena *locked = NULL;
+	unsigned long start = trace_clock();
+
+	// recorded first, as the pointers are freed by the time the loop is done
+	for (size_t i = 0; i < count && __atomic_load_n(&tracing, __ATOMIC_RELAXED); i++)
+		if (ptrs[i])
+			trace_record(OS_TRACE_FREE, start, ptrs[i], 0, NULL);
+
+	purge_start();
+	for (size_t i = 0; i < count; i++) {
+		if (!ptrs[i])
+			continue;
+
+		struct span *span = page_span(ptrs[i]);
+		struct block_meta *block = (struct block_meta *)ptrs[i] - 1;
+
+		if (!span) {
+			if (block->status == STATUS_MAPPED || block->status == STATUS_HUGETLB)
+				unmap_block(block);
+			continue;
+		}
+
+		// consecutive pointers of one arena are freed under one lock
+		if (span->arena != locked) {
+			if (locked)
+				arena_unlock(locked);
+			locked = span->arena;
+			arena_lock(locked);
+		}
+
+		if (span->kind == SPAN_SLAB) {
+			slab_free_locked(span, ptrs[i]);
+			continue;
+		}
+
+		if (block->status != STATUS_ALLOC)
+			continue;
+
+		// blocks freed in address order, as a run allocated together, coalesce once
+		while (i + 1 < count && next_is_adjacent(block) && ptrs[i + 1] == (void *)(block->next + 1) &&
+		       block->next->status == STATUS_ALLOC) {
+			absorb_next(locked, block);
+			i++;
+		}
+		heap_free(locked, block);
+	}
+	if (locked)
+		arena_unlock(locked);
+}
+
+static void *do_calloc(size_t nmemb, size_t size)
 {
-	/* TODO: Implement os_calloc */
-	size_t cc = size * nmemb;
-	size_t new_size = ALIGN_8BYTE(cc);
+	size_t cc;
 
 	if (nmemb == 0 || size == 0)
 		return NULL;
+	if (__builtin_mul_overflow(nmemb, size, &cc) || cc > MAX_ALLOC_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	if ((int)new_size < PAGE_SIZE) {
-		void *ptr = os_malloc(new_size);
+	size_t new_size = ALIGN_SIZE(cc);
+
+	// only what is not known to be zero gets cleared
+	if (new_size < PAGE_SIZE)
+		return do_malloc(new_size, OS_MALLOC_ZERO);
+
+	if (tunable(OS_M_PROF_SAMPLE) && prof_tick(new_size)) {
+		void *ptr = prof_malloc(new_size, 0, OS_MALLOC_ZERO);
 
 		if (ptr)
-			memset(ptr, 0, new_size);
-		return ptr;
+			return ptr;
 	}
-	void *block = mmap(NULL, new_size + BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return map_block(new_size, OS_MALLOC_ZERO);
+}
 
-	if (block == MAP_FAILED)
+void *os_calloc(size_t nmemb, size_t size)
+{
+	unsigned long start = trace_clock();
+	void *ptr = do_calloc(nmemb, size);
+
+	trace(OS_TRACE_CALLOC, start, (void *)nmemb, size, ptr);
+	return ptr;
+}
+
+// free the old block of a moved realloc
+static void free_moved_block(struct block_meta *block)
+{
+	if (block->status != STATUS_ALLOC) {
+		do_free(block + 1);
+		return;
+	}
+
+	struct arena *arena = arena_of(block);
+
+	arena_lock(arena);
+	flush_deferred_block(arena);
+	block->status = STATUS_FREE;
+	arena->deferred = block;
+	arena_unlock(arena);
+}
+
+// move a block to a new allocation of size bytes
+static void *move_block(struct block_meta *block, size_t size)
+{
+	void *new_block = do_malloc(size, 0);
+
+	if (!new_block)
 		return NULL;
+	memcpy(new_block, block + 1, block->size < size ? block->size : size);
+	free_moved_block(block);
+	return new_block;
+}
 
-	struct block_meta *new_block = block;
+// resize a heap block without moving it
+static int resize_block(struct arena *arena, struct block_meta *block, size_t size)
+{
+	if (block->size >= size) {
+		split_block(arena, block, size);
+		return 1;
+	}
 
-	new_block->size = new_size;
-	new_block->status = STATUS_MAPPED;
-	new_block->prev = NULL;
-	new_block->next = large_alloc;
-	if (large_alloc)
-		large_alloc->prev = new_block;
-	large_alloc = new_block;
-	memset(block + 32, 0, new_size);
-	return (void *)(new_block + 1);
+	struct block_meta *next = block->next;
+
+	if (next && next->status == STATUS_FREE && next_is_adjacent(block)) {
+		// the free neighbour stays merged even if it is not enough
+		bin_remove(arena, next);
+		absorb_next(arena, block);
+		if (block->size >= size) {
+			split_block(arena, block, size);
+			return 1;
+		}
+	}
+
+	if (block == arena->last && sbrk(0) == (char *)(block + 1) + block->size) {
+		// the last block of the sbrk heap grows in place
+		size_t grow = heap_growth(size - block->size);
+		char *heap = heap_sbrk(grow);
+
+		if (heap == (void *)-1)
+			return 0;
+		if (heap != (char *)(block + 1) + block->size) {
+			// something moved the break in between, the new pages are a block of their own
+			heap_append(arena, heap, grow);
+			return 0;
+		}
+		block->size += grow;
+		split_block(arena, block, size);
+		return 1;
+	}
+
+	return 0;
 }
 
-// remove a block from the mmap list
-void remove_from_mmap_list(struct block_meta *block)
+// resize a mapped block by moving its pages, growing it by at least half its length
+static void *remap_block(struct block_meta *block, size_t size)
 {
-	if (!block || block->status != STATUS_MAPPED)
-		return;
+	size_t old_length = map_length(block->size);
+	size_t length = map_length(size);
 
-	if (block->prev)
-		block->prev->next = block->next;
-	else
-		large_alloc = block->next;
+	// growth left over from an earlier remap is used first
+	if (size <= block->size && length > old_length / 2)
+		return block + 1;
 
-	if (block->next)
-		block->next->prev = block->prev;
+	if (length > old_length && length < old_length + old_length / 2)
+		length = map_length(old_length + old_length / 2);
 
-	block->prev = NULL;
-	block->next = NULL;
-	block->status = STATUS_FREE;  // Assuming it's now a free block
+	struct block_meta *new_block = sys_mremap(block, old_length, length, MREMAP_MAYMOVE);
+
+	if (new_block == MAP_FAILED)
+		return NULL;
+
+	if (new_block != block && __atomic_load_n(&prof_live, __ATOMIC_RELAXED))
+		prof_move(block + 1, new_block + 1);
+	count_mapped((long)(length - BLOCK_SIZE) - (long)new_block->size, 0);
+	new_block->size = length - BLOCK_SIZE;
+	return new_block + 1;
 }
 
-void *os_realloc(void *ptr, size_t size)
+static void *do_realloc(void *ptr, size_t size)
 {
 	if (!size) {
-		os_free(ptr);
-		ptr = NULL;
+		do_free(ptr);
 		return NULL;
 	}
 
 	if (!ptr)
-		return os_malloc(size);
-
-	if (!size && !ptr)
+		return do_malloc(size, 0);
+	if (size > MAX_ALLOC_SIZE) {
+		errno = ENOMEM;
 		return NULL;
+	}
 
-	size_t new_size = ALIGN_8BYTE(size);
-	struct block_meta *block = ptr - 32; // Point to the metadata
-
-	if (new_size < MMAP_THRESHOLD - BLOCK_SIZE) {
-		struct block_meta *verify = search_block_sbrk(block);
+	size_t new_size = ALIGN_SIZE(size);
+	struct span *span = page_span(ptr);
 
-		if (!verify) {
-			// we must remove the block from the mmap list
-			remove_from_mmap_list(block);
-			// and add it to the sbrk list
-			struct block_meta *new_block = get_free_block(new_size);
+	if (span && span->kind == SPAN_SLAB) {
+		// slots are never resized
+		size_t slot_size = span->size_class;
 
-			if (new_block) {
-				new_block->status = STATUS_ALLOC;
-				split_block(new_block, new_size);
-				coalesce_blocks();
-				memcpy(new_block, ptr, block->size);
-				return (void *)(new_block + 1);
-			}
+		if (new_size <= slot_size)
+			return ptr;
 
-			// if we can't find a free block, we need to expand the heap
-			expand_heap(new_size);
-			new_block = get_free_block(new_size);
-			if (new_block) {
-				new_block->status = STATUS_ALLOC;
-				split_block(new_block, new_size);
-				coalesce_blocks();
-				memcpy(new_block, ptr, block->size);
-				return (void *)(new_block + 1);
-			}
-			return NULL;
-		}
+		void *new_ptr = do_malloc(new_size, 0);
 
-		// the block is from heap allocation
-		if (block->size >= new_size) {
-			split_block(block, new_size);
-			coalesce_blocks();
-			return ptr;
+		if (new_ptr) {
+			memcpy(new_ptr, ptr, slot_size);
+			slab_free(span, ptr);
 		}
-			struct block_meta *next = block->next;
-
-			if (next && next->status == STATUS_FREE && block->size + next->size + BLOCK_SIZE >= new_size) {
-				block->size += next->size + BLOCK_SIZE;
-				block->next = next->next;
-				if (next->next)
-					next->next->prev = block;
-				split_block(block, new_size);
-				coalesce_blocks();
-				return ptr;
-			}
-			void *new_block = os_malloc(new_size);
-
-			if (!new_block)
-				return NULL;
-			memcpy(new_block, ptr, block->size);
-			os_free(ptr);
-			coalesce_blocks();
-			return new_block;
+		return new_ptr;
 	}
 
-	// the block is from mmap allocation
-	struct block_meta *verify = search_block_sbrk(block);
+	struct block_meta *block = (struct block_meta *)ptr - 1;
 
-	if (verify) {
-		// we must remove the block from the sbrk list
-		if (block->prev)
-			block->prev->next = block->next;
-		else
-			global_base = block->next;
+	if (block->status == STATUS_FREE || block->status == STATUS_CACHED)
+		return NULL;
 
-		if (block->next)
-			block->next->prev = block->prev;
+	if (!span || new_size + BLOCK_SIZE >= mmap_threshold()) {
+		if (!span && new_size + BLOCK_SIZE >= mmap_threshold() && tunable(OS_M_MREMAP) &&
+		    block->status == STATUS_MAPPED && starts_mapping(block)) {
+			void *new_ptr = remap_block(block, new_size);
 
-		block->status = STATUS_FREE;  // assuming it's now a free block
-		// we must update the size of tprevious block
-		if (block->prev) {
-			block->prev->size += block->size + BLOCK_SIZE;
-			block = block->prev;
+			if (new_ptr)
+				return new_ptr;
 		}
-		// and add it to the mmap list
-		void *new_block = os_malloc(new_size);
 
-		if (!new_block)
-			return NULL;
-		memcpy(new_block, ptr, block->size);
-		os_free(ptr);
-		coalesce_blocks();
-		return new_block;
-	}
-	// the block is from mmap and remains on mmap
-	if (block->size >= new_size) {
-		split_block(block, new_size);
-		return ptr;
+		// otherwise mapped blocks are never resized in place
+		if (!span && block->size == new_size)
+			return ptr;
+		return move_block(block, new_size);
 	}
 
-	void *new_block = os_malloc(new_size);
+	// the block is from heap allocation
+	struct arena *arena = span->arena;
 
-	if (!new_block)
-		return NULL;
-	memcpy(new_block, ptr, block->size);
-	os_free(ptr);
-	return new_block;
+	arena_lock(arena);
+	flush_deferred_block(arena);
+	int resized = resize_block(arena, block, new_size);
+
+	arena_unlock(arena);
+	if (resized)
+		return ptr;
+
+	return move_block(block, new_size);
 }
 
+void *os_realloc(void *ptr, size_t size)
+{
+	unsigned long start = trace_clock();
+	void *new_ptr = do_realloc(ptr, size);
+
+	trace(OS_TRACE_REALLOC, start, ptr, size, new_ptr);
+	return new_ptr;
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define MAP_POOL_NODES 8
+
+// root of the page map, pointing to nodes of the same size, pointing to leaves of spans
+void *page_map[PAGE_MAP_NODE];
+
+// first nodes come from here, so mapping the sbrk heap costs no syscall
+static void *map_pool[MAP_POOL_NODES][PAGE_MAP_NODE];
+static int map_pool_used;
+pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// obtain a zeroed node of the page map
+static void **map_node(void)
+{
+	if (map_pool_used < MAP_POOL_NODES)
+		return map_pool[map_pool_used++];
+
+	void **node = sys_mmap(NULL, sizeof(map_pool[0]), PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return node == MAP_FAILED ? NULL : node;
+}
+
+// obtain the slot of a page in the map, creating the missing nodes
+static struct span **map_slot(uintptr_t page)
+{
+	void **slot = &page_map[(page >> (2 * PAGE_MAP_BITS)) & (PAGE_MAP_NODE - 1)];
+
+	for (int level = 1; level >= 0; level--) {
+		void **node = *slot;
+
+		if (!node) {
+			node = map_node();
+			if (!node)
+				return NULL;
+			__atomic_store_n(slot, node, __ATOMIC_RELEASE);
+		}
+		slot = &node[(page >> (level * PAGE_MAP_BITS)) & (PAGE_MAP_NODE - 1)];
+	}
+	return (struct span **)slot;
+}
+
+// point every page of [start, start + size) to span, or to nothing if span is NULL
+int page_map_set(void *start, size_t size, struct span *span)
+{
+	uintptr_t first = (uintptr_t)start >> PAGE_SHIFT;
+	uintptr_t last = ((uintptr_t)start + size - 1) >> PAGE_SHIFT;
+	int ret = 0;
+
+	pthread_mutex_lock(&map_mutex);
+	for (uintptr_t page = first; page <= last; page++) {
+		struct span **slot = map_slot(page);
+
+		if (!slot) {
+			ret = -1;
+			break;
+		}
+		__atomic_store_n(slot, span, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&map_mutex);
+	return ret;
+}
+
+// call fn for every run of pages pointing to the same span, without locking the map
+void page_map_walk(void (*fn)(char *start, size_t size, struct span *span, void *arg), void *arg)
+{
+	struct span *run_span = NULL;
+	uintptr_t run_start = 0, run_end = 0;
+
+	for (uintptr_t i = 0; i < PAGE_MAP_NODE; i++) {
+		void **node = __atomic_load_n(&page_map[i], __ATOMIC_ACQUIRE);
+
+		for (uintptr_t j = 0; node && j < PAGE_MAP_NODE; j++) {
+			struct span **leaf = __atomic_load_n(&node[j], __ATOMIC_ACQUIRE);
+
+			for (uintptr_t k = 0; leaf && k < PAGE_MAP_NODE; k++) {
+				struct span *span = __atomic_load_n(&leaf[k], __ATOMIC_ACQUIRE);
+				uintptr_t page = (i << (2 * PAGE_MAP_BITS)) | (j << PAGE_MAP_BITS) | k;
+
+				if (span != run_span || page != run_end) {
+					if (run_span)
+						fn((char *)(run_start << PAGE_SHIFT),
+						   (run_end - run_start) << PAGE_SHIFT, run_span, arg);
+					run_span = span;
+					run_start = page;
+				}
+				run_end = page + 1;
+			}
+		}
+	}
+	if (run_span)
+		fn((char *)(run_start << PAGE_SHIFT), (run_end - run_start) << PAGE_SHIFT, run_span, arg);
+}
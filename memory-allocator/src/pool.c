@@ -0,0 +1,443 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <string.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define POOL_SLAB (64 * 1024)
+#define POOL_MIN_OBJECTS 8
+#define POOL_SLAB_HEADER_SIZE sizeof(struct pool_slab)
+
+/*
+ * A pool hands out objects of one size from slabs aligned to their size, so
+ * the slab of an object is found by masking its address. Each slab keeps a
+ * LIFO list of its freed objects, linked through their first word, and
+ * hands out the objects it never did by bumping a pointer. Slabs with room
+ * sit on the partial list of the pool, all of them on its slab list; one
+ * that empties is unmapped, or has its pages past the header given back if
+ * it is the last one.
+ */
+struct pool_slab {
+	struct pool_slab *next;		/* on the partial list of the pool */
+	struct pool_slab *prev;
+	struct pool_slab *next_slab;	/* on the slab list of the pool */
+	struct pool_slab *prev_slab;
+	void *free;			/* freed objects */
+	char *fresh;			/* first object never handed out */
+	char *end;
+	unsigned int used;
+};
+
+/*
+ * Pools are never freed, only reused by later os_pool_create() calls, with
+ * id changed on each destroy: a magazine that outlives its pool finds out
+ * without touching memory that is gone.
+ */
+struct os_pool {
+	pthread_mutex_t mutex;
+	struct os_pool *next;		/* in the list of all pools */
+	unsigned long id;
+	int live;
+	unsigned int index;		/* of its magazine in the table of each thread */
+	size_t stride;			/* object size rounded up to the alignment */
+	size_t slab_size;
+	size_t first;			/* offset of the first object of a slab */
+	struct pool_slab *partial;
+	struct pool_slab *slabs;
+	size_t slab_count;
+};
+
+/*
+ * Per-thread magazines, with OS_M_POOL_MAGAZINE set: a stack of objects
+ * of one pool, taken from and given back to the pool half a magazine at a
+ * time under its lock. Each thread has a table of them indexed by pool,
+ * grown as it meets pools created later.
+ */
+struct pool_magazine {
+	struct os_pool *pool;
+	unsigned long id;
+	void *head;
+	unsigned int count;
+};
+
+static struct os_pool *all_pools;
+static unsigned long pool_ids;
+static unsigned int pool_count;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct pool_magazine *magazines __attribute__((tls_model("initial-exec")));
+static __thread unsigned int magazine_slots __attribute__((tls_model("initial-exec")));
+
+// obtain the object that follows a free one
+static inline void **next_free(void *ptr)
+{
+	return (void **)ptr;
+}
+
+// obtain the slab an object of pool lies in
+static inline struct pool_slab *slab_of(struct os_pool *pool, void *ptr)
+{
+	return (struct pool_slab *)((uintptr_t)ptr & ~(uintptr_t)(pool->slab_size - 1));
+}
+
+// map a slab of size bytes aligned to its size
+static struct pool_slab *pool_map(size_t size)
+{
+	// map one slab more and cut the unaligned ends off
+	char *area = sys_mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (area == MAP_FAILED)
+		return NULL;
+
+	char *start = (char *)(((uintptr_t)area + size - 1) & ~(uintptr_t)(size - 1));
+
+	if (start > area)
+		sys_munmap(area, start - area);
+	sys_munmap(start + size, area + size - start);
+	return (struct pool_slab *)start;
+}
+
+// add a slab to the partial list of its pool
+static void partial_link(struct os_pool *pool, struct pool_slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = pool->partial;
+	if (slab->next)
+		slab->next->prev = slab;
+	pool->partial = slab;
+}
+
+// remove a slab from the partial list of its pool
+static void partial_unlink(struct os_pool *pool, struct pool_slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		pool->partial = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+// take an object of a pool, called with the pool locked
+static void *pool_take(struct os_pool *pool)
+{
+	struct pool_slab *slab = pool->partial;
+	void *ptr;
+
+	if (!slab) {
+		slab = pool_map(pool->slab_size);
+		if (!slab)
+			return NULL;
+		slab->free = NULL;
+		slab->fresh = (char *)slab + pool->first;
+		slab->end = slab->fresh + (pool->slab_size - pool->first) / pool->stride * pool->stride;
+		slab->used = 0;
+		partial_link(pool, slab);
+		slab->prev_slab = NULL;
+		slab->next_slab = pool->slabs;
+		if (slab->next_slab)
+			slab->next_slab->prev_slab = slab;
+		pool->slabs = slab;
+		pool->slab_count++;
+	}
+
+	if (slab->free) {
+		ptr = slab->free;
+		slab->free = *next_free(ptr);
+	} else {
+		ptr = slab->fresh;
+		slab->fresh += pool->stride;
+	}
+
+	slab->used++;
+	if (!slab->free && slab->fresh == slab->end)
+		partial_unlink(pool, slab);
+	return ptr;
+}
+
+// give an object back to its slab, called with the pool locked
+static void pool_put(struct os_pool *pool, void *ptr)
+{
+	struct pool_slab *slab = slab_of(pool, ptr);
+
+	if (!slab->free && slab->fresh == slab->end)
+		partial_link(pool, slab);
+
+	*next_free(ptr) = slab->free;
+	slab->free = ptr;
+
+	if (--slab->used)
+		return;
+
+	if (pool->slab_count == 1) {
+		// keep the last slab mapped, but only the page of its header resident
+		char *touched = (char *)(((uintptr_t)slab->fresh + MAP_PAGE - 1) & ~(MAP_PAGE - 1));
+		char *start = (char *)slab + MAP_PAGE;
+
+		slab->free = NULL;
+		slab->fresh = (char *)slab + pool->first;
+		if (touched > start)
+			sys_madvise(start, touched - start, MADV_DONTNEED);
+	} else {
+		// give the pages of the other empty ones back
+		partial_unlink(pool, slab);
+		if (slab->prev_slab)
+			slab->prev_slab->next_slab = slab->next_slab;
+		else
+			pool->slabs = slab->next_slab;
+		if (slab->next_slab)
+			slab->next_slab->prev_slab = slab->prev_slab;
+		pool->slab_count--;
+		sys_munmap(slab, pool->slab_size);
+	}
+}
+
+struct os_pool *os_pool_create(size_t obj_size, size_t align)
+{
+	if (!align)
+		align = sizeof(void *);
+	// the slabs, of POOL_MIN_OBJECTS objects at least, must not wrap
+	if (!obj_size || obj_size > MAX_ALLOC_SIZE / POOL_MIN_OBJECTS ||
+	    (align & (align - 1)) || align > POOL_SLAB / POOL_MIN_OBJECTS)
+		return NULL;
+
+	// tunables are read on the first call into the allocator
+	threads_multi();
+
+	size_t stride = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	stride = (stride + align - 1) & ~(align - 1);
+
+	size_t first = (POOL_SLAB_HEADER_SIZE + align - 1) & ~(align - 1);
+	size_t slab_size = POOL_SLAB;
+
+	while (slab_size && slab_size - first < POOL_MIN_OBJECTS * stride)
+		slab_size *= 2;
+	if (!slab_size)
+		return NULL;
+
+	struct os_pool *pool;
+
+	pthread_mutex_lock(&pool_mutex);
+	for (pool = all_pools; pool; pool = pool->next)
+		if (!pool->live)
+			break;
+
+	if (!pool) {
+		pool = do_malloc(sizeof(*pool), 0);
+		if (!pool) {
+			pthread_mutex_unlock(&pool_mutex);
+			return NULL;
+		}
+		pthread_mutex_init(&pool->mutex, NULL);
+		pool->index = pool_count++;
+		pool->next = all_pools;
+		all_pools = pool;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->id = ++pool_ids;
+	pool->live = 1;
+	pool->stride = stride;
+	pool->slab_size = slab_size;
+	pool->first = first;
+	pool->partial = NULL;
+	pool->slabs = NULL;
+	pool->slab_count = 0;
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&pool_mutex);
+	return pool;
+}
+
+// give count objects of a magazine back to its pool, or drop them all if the pool is gone
+static void magazine_flush(struct pool_magazine *magazine, unsigned int count)
+{
+	struct os_pool *pool = magazine->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->id != magazine->id) {
+		// their slabs are unmapped
+		magazine->head = NULL;
+		magazine->count = 0;
+	}
+	while (count-- && magazine->head) {
+		void *ptr = magazine->head;
+
+		magazine->head = *next_free(ptr);
+		magazine->count--;
+		pool_put(pool, ptr);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// grow the magazine table of the calling thread to hold index, NULL if out of memory
+static struct pool_magazine *magazine_grow(unsigned int index)
+{
+	unsigned int slots = magazine_slots ? 2 * magazine_slots : 4;
+
+	while (slots <= index)
+		slots *= 2;
+
+	struct pool_magazine *table = do_malloc(slots * sizeof(*table), 0);
+
+	if (!table)
+		return NULL;
+	memset(table, 0, slots * sizeof(*table));
+	if (magazines) {
+		memcpy(table, magazines, magazine_slots * sizeof(*table));
+		do_free(magazines);
+	} else {
+		// flush the magazines when the thread exits
+		threads_multi();
+		thread_register();
+	}
+	magazines = table;
+	magazine_slots = slots;
+	return &magazines[index];
+}
+
+// obtain the magazine of the calling thread for a pool, NULL if they are off
+static struct pool_magazine *magazine_of(struct os_pool *pool)
+{
+	struct pool_magazine *magazine = pool->index < magazine_slots ? &magazines[pool->index] : NULL;
+
+	if (magazine && magazine->pool == pool && magazine->id == pool->id)
+		return magazine;
+	if (!tunable(OS_M_POOL_MAGAZINE))
+		return NULL;
+
+	if (!magazine) {
+		magazine = magazine_grow(pool->index);
+		if (!magazine)
+			return NULL;
+	} else if (magazine->pool && magazine->count) {
+		// the magazine holds objects of this pool from before a destroy
+		magazine_flush(magazine, magazine->count);
+	}
+
+	magazine->pool = pool;
+	magazine->id = pool->id;
+	magazine->head = NULL;
+	magazine->count = 0;
+	return magazine;
+}
+
+void *os_pool_alloc(struct os_pool *pool)
+{
+	struct pool_magazine *magazine = magazine_of(pool);
+	void *ptr;
+
+	if (magazine && magazine->head) {
+		ptr = magazine->head;
+		magazine->head = *next_free(ptr);
+		magazine->count--;
+		return ptr;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	ptr = pool_take(pool);
+
+	// fill half the magazine under the same lock
+	if (ptr && magazine) {
+		unsigned int count = (tunable(OS_M_POOL_MAGAZINE) + 1) / 2;
+
+		while (magazine->count < count) {
+			void *more = pool_take(pool);
+
+			if (!more)
+				break;
+			*next_free(more) = magazine->head;
+			magazine->head = more;
+			magazine->count++;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return ptr;
+}
+
+void os_pool_free(struct os_pool *pool, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	struct pool_magazine *magazine = magazine_of(pool);
+
+	if (!magazine) {
+		pthread_mutex_lock(&pool->mutex);
+		pool_put(pool, ptr);
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+
+	if (magazine->count >= (unsigned int)tunable(OS_M_POOL_MAGAZINE))
+		magazine_flush(magazine, (magazine->count + 1) / 2);
+	*next_free(ptr) = magazine->head;
+	magazine->head = ptr;
+	magazine->count++;
+}
+
+void os_pool_destroy(struct os_pool *pool)
+{
+	if (!pool)
+		return;
+
+	// objects in the magazine of the calling thread go with the slabs
+	struct pool_magazine *magazine = pool->index < magazine_slots ? &magazines[pool->index] : NULL;
+
+	if (magazine && magazine->pool == pool) {
+		magazine->pool = NULL;
+		magazine->head = NULL;
+		magazine->count = 0;
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	pthread_mutex_lock(&pool->mutex);
+	// the magazines of other threads see the new id and drop what they hold
+	pool->id = ++pool_ids;
+	pool->live = 0;
+	while (pool->slabs) {
+		struct pool_slab *slab = pool->slabs;
+
+		pool->slabs = slab->next_slab;
+		sys_munmap(slab, pool->slab_size);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+// give the magazines of an exiting thread back to their pools
+void pool_thread_exit(void)
+{
+	for (unsigned int i = 0; i < magazine_slots; i++)
+		if (magazines[i].pool && magazines[i].count)
+			magazine_flush(&magazines[i], magazines[i].count);
+	do_free(magazines);
+	magazines = NULL;
+	magazine_slots = 0;
+}
+
+// take the locks of every pool around fork(), before those of the arenas
+void pool_fork_lock(void)
+{
+	pthread_mutex_lock(&pool_mutex);
+	for (struct os_pool *pool = all_pools; pool; pool = pool->next)
+		pthread_mutex_lock(&pool->mutex);
+}
+
+void pool_fork_unlock(void)
+{
+	for (struct os_pool *pool = all_pools; pool; pool = pool->next)
+		pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_fork_child(void)
+{
+	for (struct os_pool *pool = all_pools; pool; pool = pool->next)
+		pthread_mutex_init(&pool->mutex, NULL);
+	pthread_mutex_init(&pool_mutex, NULL);
+}
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <malloc.h>
+#include <errno.h>
+#include "osmem.h"
+#include "heap.h"
+
+/*
+ * The standard allocation functions over the os_* ones, linked only into
+ * libosmem_preload.so: LD_PRELOAD it to have a program allocate from
+ * libosmem unchanged. Everything that can hand memory to free() is here,
+ * as glibc versions left in place would hand it glibc chunks. malloc(0)
+ * and the like return a unique pointer, as glibc's do, since programs
+ * take NULL for out of memory.
+ */
+
+void *malloc(size_t size)
+{
+	return os_malloc(size ? size : 1);
+}
+
+void free(void *ptr)
+{
+	os_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (!nmemb || !size)
+		return os_malloc(1);
+	return os_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return malloc(size);
+	return os_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	return os_posix_memalign(memptr, align, size ? size : 1);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return os_aligned_alloc(align, size ? size : 1);
+}
+
+void *memalign(size_t align, size_t size)
+{
+	return os_memalign(align, size ? size : 1);
+}
+
+void *valloc(size_t size)
+{
+	return os_memalign(MAP_PAGE, size ? size : 1);
+}
+
+void *pvalloc(size_t size)
+{
+	return os_memalign(MAP_PAGE, size ? (size + MAP_PAGE - 1) & ~(MAP_PAGE - 1) : MAP_PAGE);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	return os_malloc_usable_size(ptr);
+}
+
+/*
+ * operator new and delete, by their mangled names. A failing new calls the
+ * new handler of the program and retries, as the standard wants, or throws
+ * std::bad_alloc through libstdc++, which any program calling them loaded.
+ */
+
+typedef void (*new_handler_t)(void);
+
+new_handler_t _ZSt15get_new_handlerv(void) __attribute__((weak));
+void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+// allocate for operator new, aligned to align if it is not 0; NULL only if nothrow is set
+void *cxx_new(size_t size, size_t align, int nothrow)
+{
+	for (;;) {
+		void *ptr = align ? os_aligned_alloc(align, size ? size : 1) : os_malloc(size ? size : 1);
+
+		if (ptr)
+			return ptr;
+
+		new_handler_t handler = _ZSt15get_new_handlerv ? _ZSt15get_new_handlerv() : NULL;
+
+		if (handler) {
+			handler();
+			continue;
+		}
+		if (nothrow)
+			return NULL;
+		if (_ZSt17__throw_bad_allocv)
+			_ZSt17__throw_bad_allocv();
+		abort();
+	}
+}
+
+/* operator new(size_t), new[](size_t) and their nothrow forms */
+void *_Znwm(size_t size)
+{
+	return cxx_new(size, 0, 0);
+}
+
+void *_Znam(size_t size)
+{
+	return cxx_new(size, 0, 0);
+}
+
+void *_ZnwmRKSt9nothrow_t(size_t size, const void *tag)
+{
+	(void)tag;
+	return cxx_new(size, 0, 1);
+}
+
+void *_ZnamRKSt9nothrow_t(size_t size, const void *tag)
+{
+	(void)tag;
+	return cxx_new(size, 0, 1);
+}
+
+/* The same with std::align_val_t */
+void *_ZnwmSt11align_val_t(size_t size, size_t align)
+{
+	return cxx_new(size, align, 0);
+}
+
+void *_ZnamSt11align_val_t(size_t size, size_t align)
+{
+	return cxx_new(size, align, 0);
+}
+
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag)
+{
+	(void)tag;
+	return cxx_new(size, align, 1);
+}
+
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag)
+{
+	(void)tag;
+	return cxx_new(size, align, 1);
+}
+
+/* operator delete(void *), delete[](void *), and their sized and nothrow forms */
+void _ZdlPv(void *ptr)
+{
+	os_free(ptr);
+}
+
+void _ZdaPv(void *ptr)
+{
+	os_free(ptr);
+}
+
+void _ZdlPvm(void *ptr, size_t size)
+{
+	os_free_sized(ptr, size);
+}
+
+void _ZdaPvm(void *ptr, size_t size)
+{
+	os_free_sized(ptr, size);
+}
+
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+	(void)tag;
+	os_free(ptr);
+}
+
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+	(void)tag;
+	os_free(ptr);
+}
+
+/* The same with std::align_val_t */
+void _ZdlPvSt11align_val_t(void *ptr, size_t align)
+{
+	(void)align;
+	os_free(ptr);
+}
+
+void _ZdaPvSt11align_val_t(void *ptr, size_t align)
+{
+	(void)align;
+	os_free(ptr);
+}
+
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+{
+	(void)align;
+	os_free_sized(ptr, size);
+}
+
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+{
+	(void)align;
+	os_free_sized(ptr, size);
+}
+
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag)
+{
+	(void)align;
+	(void)tag;
+	os_free(ptr);
+}
+
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag)
+{
+	(void)align;
+	(void)tag;
+	os_free(ptr);
+}
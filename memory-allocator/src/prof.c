@@ -0,0 +1,450 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "printf.h"
+#include "osmem.h"
+#include "heap.h"
+
+#define PROF_DEPTH 32
+#define PROF_SITES 16384
+#define PROF_SAMPLES 65536
+#define PROF_BUCKETS 16384
+#define PROF_PATH 256
+#define PROF_PAGES 64
+
+/*
+ * Sampling heap profiler: with OS_M_PROF_SAMPLE set, about one allocation
+ * every that many bytes, exponentially spaced, is sampled. A sampled
+ * allocation gets an mmap'd block of its own, so only frees of mmap'd
+ * blocks ever look for a sample, and the pages of small ones are kept for
+ * the next samples. A sample is charged to the call site found by
+ * backtrace(). Profiles are written in the text format of gperftools heap
+ * profiles, which pprof reads and scales back up by the sampling period.
+ */
+
+// a distinct stack allocations were sampled at
+struct prof_site {
+	struct prof_site *next;		/* in its hash bucket */
+	unsigned long live_count;
+	unsigned long live_bytes;
+	unsigned long total_count;
+	unsigned long total_bytes;
+	int depth;
+	void *frames[PROF_DEPTH];
+};
+
+// a live sampled allocation
+struct prof_sample {
+	struct prof_sample *next;	/* in its hash bucket, or in the free list */
+	void *ptr;
+	size_t size;
+	struct prof_site *site;
+};
+
+// the tables of the profiler, mmap'd in one piece the first time they are needed
+struct prof_tables {
+	struct prof_site *site_buckets[PROF_BUCKETS];
+	struct prof_sample *sample_buckets[PROF_BUCKETS];
+	struct prof_site sites[PROF_SITES];
+	struct prof_sample samples[PROF_SAMPLES];
+};
+
+static struct prof_tables *prof_tables;
+static size_t prof_sites_used;
+static size_t prof_samples_used;
+static struct prof_sample *prof_free_samples;
+static struct block_meta *prof_pages[PROF_PAGES];
+static int prof_pages_kept;
+static unsigned int prof_dumps;
+pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+
+// samples not freed yet, checked before looking one up
+long prof_live;
+
+// a dump asked for by the profile signal, written by the next sampled allocation
+static int prof_dump_pending;
+
+// text of libosmem, whose frames are left out of the stacks
+static uintptr_t prof_text_start;
+static uintptr_t prof_text_end;
+
+static char prof_prefix[PROF_PATH] = "osmem";
+
+__thread long prof_left __attribute__((tls_model("initial-exec")));
+static __thread uint64_t prof_rng __attribute__((tls_model("initial-exec")));
+static __thread int prof_busy __attribute__((tls_model("initial-exec")));
+
+// find the text segment of the object this function is in
+static int find_text(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	uintptr_t self = (uintptr_t)arg;
+
+	(void)size;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+		if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+		    self >= start && self < start + phdr->p_memsz) {
+			prof_text_start = start;
+			prof_text_end = start + phdr->p_memsz;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void prof_signal(int signo)
+{
+	(void)signo;
+	__atomic_store_n(&prof_dump_pending, 1, __ATOMIC_RELAXED);
+}
+
+static void prof_init(void)
+{
+	struct prof_tables *tables = sys_mmap(NULL, sizeof(*tables), PROT_READ | PROT_WRITE,
+					      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (tables == MAP_FAILED)
+		return;
+	prof_tables = tables;
+
+	dl_iterate_phdr(find_text, (void *)(uintptr_t)find_text);
+
+	char *prefix = getenv("OSMEM_PROF_PREFIX");
+
+	if (prefix && *prefix && strlen(prefix) < PROF_PATH - 32)
+		strcpy(prof_prefix, prefix);
+
+	int signo = tunable(OS_M_PROF_SIGNAL);
+
+	if (signo) {
+		struct sigaction action = { .sa_handler = prof_signal, .sa_flags = SA_RESTART };
+
+		sigemptyset(&action.sa_mask);
+		sigaction(signo, &action, NULL);
+	}
+}
+
+// obtain log2(x) of 0 < x <= 1, to within a few thousandths
+static inline double fast_log2(double x)
+{
+	union {
+		double value;
+		uint64_t bits;
+	} u = { x };
+	int exponent = (int)((u.bits >> 52) & 0x7ff) - 1023;
+
+	// the mantissa m is in [1, 2): log2(m) = 2 atanh(t) / ln 2, t = (m - 1) / (m + 1)
+	u.bits = (u.bits & ((1UL << 52) - 1)) | (1023UL << 52);
+
+	double t = (u.value - 1) / (u.value + 1);
+	double t2 = t * t;
+
+	return exponent + t * (2.8853900817779268 + t2 * (0.9617966939259756 + t2 * 0.5770780163555854));
+}
+
+// draw the bytes to the next sample, exponentially distributed with mean period
+static long prof_interval(long period)
+{
+	uint64_t x = prof_rng;
+
+	if (!x)
+		x = (uintptr_t)&prof_rng ^ (now_ms() << 32) ^ 0x9e3779b97f4a7c15UL;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	prof_rng = x;
+
+	// u is uniform in (0, 1], and -ln(u) exponential with mean 1
+	double u = ((x >> 11) + 1) * (1.0 / (1UL << 53));
+
+	return (long)(-fast_log2(u) * 0.6931471805599453 * period) + 1;
+}
+
+// hash a stack or a pointer into a bucket
+static inline size_t prof_hash(uintptr_t value)
+{
+	value *= 0x9e3779b97f4a7c15UL;
+	return (value >> 32) % PROF_BUCKETS;
+}
+
+// obtain the site of a stack, adding it if it is new; called with prof_mutex held
+static struct prof_site *prof_site(void **frames, int depth)
+{
+	uintptr_t hash = depth;
+
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3UL;
+
+	size_t index = prof_hash(hash);
+	struct prof_site *site;
+
+	for (site = prof_tables->site_buckets[index]; site; site = site->next)
+		if (site->depth == depth && !memcmp(site->frames, frames, depth * sizeof(void *)))
+			return site;
+
+	if (prof_sites_used == PROF_SITES)
+		return NULL;
+
+	site = &prof_tables->sites[prof_sites_used++];
+	site->depth = depth;
+	memcpy(site->frames, frames, depth * sizeof(void *));
+	site->next = prof_tables->site_buckets[index];
+	prof_tables->site_buckets[index] = site;
+	return site;
+}
+
+// record a sampled allocation of size bytes at ptr, allocated from the given stack
+static void prof_record(void *ptr, size_t size, void **frames, int depth)
+{
+	pthread_mutex_lock(&prof_mutex);
+
+	struct prof_site *site = prof_site(frames, depth);
+	struct prof_sample *sample = prof_free_samples;
+
+	if (sample)
+		prof_free_samples = sample->next;
+	else if (site && prof_samples_used < PROF_SAMPLES)
+		sample = &prof_tables->samples[prof_samples_used++];
+
+	if (!site || !sample) {
+		// the tables are full, the allocation goes unrecorded
+		if (sample) {
+			sample->next = prof_free_samples;
+			prof_free_samples = sample;
+		}
+		pthread_mutex_unlock(&prof_mutex);
+		return;
+	}
+
+	size_t index = prof_hash((uintptr_t)ptr);
+
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->site = site;
+	sample->next = prof_tables->sample_buckets[index];
+	prof_tables->sample_buckets[index] = sample;
+
+	site->live_count++;
+	site->live_bytes += size;
+	site->total_count++;
+	site->total_bytes += size;
+	__atomic_fetch_add(&prof_live, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&prof_mutex);
+}
+
+// reuse the page of a freed sample for a block of size bytes, NULL if none is kept
+static void *prof_page(size_t size, int flags)
+{
+	struct block_meta *block = NULL;
+
+	pthread_mutex_lock(&prof_mutex);
+	if (prof_pages_kept)
+		block = prof_pages[--prof_pages_kept];
+	pthread_mutex_unlock(&prof_mutex);
+
+	if (!block)
+		return NULL;
+
+	block->size = size;
+	block->status = STATUS_MAPPED;
+	if (flags & OS_MALLOC_ZERO)
+		memset(block + 1, 0, size);
+	count_mapped(size, 1);
+	return block + 1;
+}
+
+// allocate a sampled block of size bytes, aligned to align if it is not 0;
+// returns NULL for the caller to allocate as usual if this one is not sampled
+void *prof_malloc(size_t size, size_t align, int flags)
+{
+	long period = tunable(OS_M_PROF_SAMPLE);
+
+	// allocations of the profiler itself, as in backtrace(), are not sampled
+	if (prof_busy || !period)
+		return NULL;
+
+	// the first allocation of a thread only draws its first interval
+	int first = !prof_rng;
+
+	prof_left = prof_interval(period) - (first ? (long)size : 0);
+	if (first && prof_left >= 0)
+		return NULL;
+
+	pthread_once(&prof_once, prof_init);
+	if (!prof_tables)
+		return NULL;
+
+	void *frames[PROF_DEPTH + 8];
+	int depth, skip = 0;
+
+	prof_busy = 1;
+	depth = backtrace(frames, PROF_DEPTH + 8);
+	prof_busy = 0;
+
+	while (skip < depth && (uintptr_t)frames[skip] >= prof_text_start && (uintptr_t)frames[skip] < prof_text_end)
+		skip++;
+	depth -= skip;
+	if (depth > PROF_DEPTH)
+		depth = PROF_DEPTH;
+
+	void *ptr;
+
+	if (align)
+		ptr = map_aligned(size, align);
+	else if (map_length(size) > MAP_PAGE || !(ptr = prof_page(size, flags)))
+		ptr = map_block(size, size + BLOCK_SIZE < mmap_threshold() ? flags & OS_MALLOC_ZERO : flags);
+	if (!ptr)
+		return NULL;
+
+	prof_record(ptr, size, frames + skip, depth);
+
+	if (__atomic_load_n(&prof_dump_pending, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&prof_dump_pending, 0, __ATOMIC_RELAXED))
+		os_malloc_prof_dump(NULL);
+	return ptr;
+}
+
+// take the sample at ptr out of the tables; called with prof_mutex held
+static struct prof_sample *prof_unlink(void *ptr)
+{
+	struct prof_sample **link = &prof_tables->sample_buckets[prof_hash((uintptr_t)ptr)];
+
+	for (; *link; link = &(*link)->next) {
+		struct prof_sample *sample = *link;
+
+		if (sample->ptr == ptr) {
+			*link = sample->next;
+			return sample;
+		}
+	}
+	return NULL;
+}
+
+// forget the sample of a freed mmap'd block, if it was one;
+// returns 1 if the profiler kept the page of the block
+int prof_free(struct block_meta *block)
+{
+	int kept = 0;
+
+	pthread_mutex_lock(&prof_mutex);
+
+	struct prof_sample *sample = prof_unlink(block + 1);
+
+	if (sample) {
+		sample->site->live_count--;
+		sample->site->live_bytes -= sample->size;
+		sample->next = prof_free_samples;
+		prof_free_samples = sample;
+		__atomic_fetch_sub(&prof_live, 1, __ATOMIC_RELAXED);
+
+		if (block->status == STATUS_MAPPED && !((uintptr_t)block & (MAP_PAGE - 1)) &&
+		    map_length(block->size) == MAP_PAGE && prof_pages_kept < PROF_PAGES) {
+			block->status = STATUS_FREE;
+			prof_pages[prof_pages_kept++] = block;
+			kept = 1;
+		}
+	}
+	pthread_mutex_unlock(&prof_mutex);
+	return kept;
+}
+
+// follow a sampled block that mremap moved from old_ptr to new_ptr
+void prof_move(void *old_ptr, void *new_ptr)
+{
+	pthread_mutex_lock(&prof_mutex);
+
+	struct prof_sample *sample = prof_unlink(old_ptr);
+
+	if (sample) {
+		size_t index = prof_hash((uintptr_t)new_ptr);
+
+		sample->ptr = new_ptr;
+		sample->next = prof_tables->sample_buckets[index];
+		prof_tables->sample_buckets[index] = sample;
+	}
+	pthread_mutex_unlock(&prof_mutex);
+}
+
+// copy the memory map of the process to a dump, for pprof to symbolize with
+static void dump_maps(struct dump *dump)
+{
+	int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	ssize_t ret;
+
+	if (fd < 0)
+		return;
+
+	dump_flush(dump);
+	while ((ret = read(fd, dump->buf, DUMP_BUFFER)) > 0) {
+		dump->len = ret;
+		dump_flush(dump);
+	}
+	close(fd);
+}
+
+int os_malloc_prof_dump(const char *path)
+{
+	char name[PROF_PATH];
+	struct dump dump;
+
+	tunables_init();
+	pthread_once(&prof_once, prof_init);
+	if (!prof_tables) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!path) {
+		unsigned int seq = __atomic_fetch_add(&prof_dumps, 1, __ATOMIC_RELAXED);
+
+		snprintf_(name, sizeof(name), "%s.%d.%04u.heap", prof_prefix, (int)getpid(), seq);
+		path = name;
+	}
+
+	dump.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	dump.len = 0;
+	if (dump.fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&prof_mutex);
+
+	unsigned long live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+
+	for (size_t i = 0; i < prof_sites_used; i++) {
+		live_count += prof_tables->sites[i].live_count;
+		live_bytes += prof_tables->sites[i].live_bytes;
+		total_count += prof_tables->sites[i].total_count;
+		total_bytes += prof_tables->sites[i].total_bytes;
+	}
+
+	fctprintf(dump_char, &dump, "heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%d\n",
+		  live_count, live_bytes, total_count, total_bytes, tunable(OS_M_PROF_SAMPLE));
+	for (size_t i = 0; i < prof_sites_used; i++) {
+		struct prof_site *site = &prof_tables->sites[i];
+
+		fctprintf(dump_char, &dump, "%6lu: %8lu [%6lu: %8lu] @",
+			  site->live_count, site->live_bytes, site->total_count, site->total_bytes);
+		for (int j = 0; j < site->depth; j++)
+			fctprintf(dump_char, &dump, " 0x%016lx", (unsigned long)site->frames[j]);
+		dump_char('\n', &dump);
+	}
+	pthread_mutex_unlock(&prof_mutex);
+
+	fctprintf(dump_char, &dump, "\nMAPPED_LIBRARIES:\n");
+	dump_maps(&dump);
+	dump_flush(&dump);
+	close(dump.fd);
+	return 0;
+}
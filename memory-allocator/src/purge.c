@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+/*
+ * Free pages decay like jemalloc's: a free block of a power of two bin is
+ * dirty when binned, goes muzzy (MADV_FREE) once it stayed dirty for
+ * OS_M_DIRTY_DECAY milliseconds, then clean (MADV_DONTNEED, or cut off the
+ * sbrk heap) after OS_M_MUZZY_DECAY more. Cached mmap'd blocks are unmapped
+ * after OS_M_LARGE_DECAY. A thread does all of this every
+ * OS_M_PURGE_INTERVAL milliseconds, so malloc and free never do.
+ */
+
+// time of the last pass, stamped on the blocks binned until the next one
+unsigned long purge_clock;
+
+static struct os_purge_stats purge_stats;
+pthread_mutex_t purge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int purger_running;
+static pthread_once_t purge_once = PTHREAD_ONCE_INIT;
+
+// purge the arenas and the large cache, everything that is free if force is set;
+// return the pages given back from the arenas
+static size_t purge_pass(int force)
+{
+	unsigned long now = now_ms();
+	int used = __atomic_load_n(&arenas_used, __ATOMIC_RELAXED);
+	size_t pages;
+
+	pthread_mutex_lock(&purge_mutex);
+	pages = purge_stats.pages_muzzy + purge_stats.pages_purged + purge_stats.pages_trimmed;
+	__atomic_store_n(&purge_clock, now, __ATOMIC_RELAXED);
+	for (int i = 0; i < used; i++)
+		heap_purge(&arenas[i], now, force, &purge_stats);
+	purge_stats.large_released += large_cache_decay(force ? 0 : tunable(OS_M_LARGE_DECAY));
+	purge_stats.passes++;
+	pages = purge_stats.pages_muzzy + purge_stats.pages_purged + purge_stats.pages_trimmed - pages;
+	pthread_mutex_unlock(&purge_mutex);
+	return pages;
+}
+
+// run passes until the interval is set back to 0
+static void *purge_thread(void *arg)
+{
+	int interval;
+
+	(void)arg;
+	while ((interval = tunable(OS_M_PURGE_INTERVAL)) > 0) {
+		struct timespec ts = { interval / 1000, interval % 1000 * 1000000L };
+
+		nanosleep(&ts, NULL);
+		purge_pass(0);
+	}
+	__atomic_store_n(&purger_running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// the purger does not survive fork, the child starts its own
+static void purge_fork_child(void)
+{
+	purger_running = 0;
+}
+
+static void purge_init(void)
+{
+	pthread_atfork(NULL, NULL, purge_fork_child);
+}
+
+// start the purger thread if it is enabled and not running, called with no arena locked
+void purge_start(void)
+{
+	if (__atomic_load_n(&purger_running, __ATOMIC_ACQUIRE) || !tunable(OS_M_PURGE_INTERVAL))
+		return;
+
+	// creating the thread allocates, and that must not start another one
+	if (__atomic_exchange_n(&purger_running, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_once(&purge_once, purge_init);
+	__atomic_store_n(&purge_clock, now_ms(), __ATOMIC_RELAXED);
+
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+
+	// keep the signals of the process away from the purger
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, purge_thread, NULL))
+		__atomic_store_n(&purger_running, 0, __ATOMIC_RELEASE);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void os_malloc_purge_stats(struct os_purge_stats *stats)
+{
+	pthread_mutex_lock(&purge_mutex);
+	*stats = purge_stats;
+	pthread_mutex_unlock(&purge_mutex);
+}
+
+size_t os_malloc_purge(void)
+{
+	tunables_init();
+	return purge_pass(1);
+}
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "heap.h"
+
+#define REGION_ALIGN 16
+#define REGION_CHUNK (64 * 1024)
+#define REGION_MAX_CHUNK (4 * 1024 * 1024)
+#define REGION_HEADER_SIZE ((sizeof(struct os_arena) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1))
+
+/*
+ * A region hands out memory by bumping a pointer through a list of chunks,
+ * allocated with do_malloc() like any other block, so they come from the
+ * heaps or are mmap'd depending on their size. Each chunk is twice the size
+ * of the one before, up to REGION_MAX_CHUNK. A reset moves the pointer back
+ * to the first chunk and walks the same chunks again. Allocations too large
+ * for a chunk get a block of their own, freed at the reset. The region
+ * itself lives at the start of its first chunk.
+ */
+struct region_chunk {
+	struct region_chunk *next;
+	size_t size;			/* bytes after the header */
+};
+
+struct os_arena {
+	char *ptr;			/* next free byte of the current chunk */
+	char *end;			/* end of the current chunk */
+	struct region_chunk *first;
+	struct region_chunk *current;
+	struct region_chunk *large;	/* blocks of single large allocations */
+	size_t chunk_size;		/* size of the next chunk allocated */
+};
+
+// obtain the first aligned byte of a chunk after its header
+static inline char *chunk_data(struct region_chunk *chunk)
+{
+	return (char *)(((uintptr_t)(chunk + 1) + REGION_ALIGN - 1) & ~(uintptr_t)(REGION_ALIGN - 1));
+}
+
+// allocate a chunk of size bytes after the header, blocks being aligned to 8 bytes only
+static struct region_chunk *chunk_create(size_t size)
+{
+	struct region_chunk *chunk = do_malloc(sizeof(*chunk) + REGION_ALIGN - 8 + size, 0);
+
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+struct os_arena *os_arena_create(size_t chunk_size)
+{
+	if (!chunk_size)
+		chunk_size = REGION_CHUNK;
+	chunk_size = (chunk_size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+	if (chunk_size > REGION_MAX_CHUNK)
+		chunk_size = REGION_MAX_CHUNK;
+
+	struct region_chunk *chunk = chunk_create(REGION_HEADER_SIZE + chunk_size);
+
+	if (!chunk)
+		return NULL;
+
+	struct os_arena *region = (struct os_arena *)chunk_data(chunk);
+
+	region->first = chunk;
+	region->current = chunk;
+	region->large = NULL;
+	region->ptr = chunk_data(chunk) + REGION_HEADER_SIZE;
+	region->end = chunk_data(chunk) + chunk->size;
+	region->chunk_size = chunk_size * 2 < REGION_MAX_CHUNK ? chunk_size * 2 : REGION_MAX_CHUNK;
+	return region;
+}
+
+// allocate from a block of its own an allocation larger than chunks are
+static void *large_alloc(struct os_arena *region, size_t align, size_t size)
+{
+	struct region_chunk *chunk = chunk_create(size + align - REGION_ALIGN);
+
+	if (!chunk)
+		return NULL;
+	chunk->next = region->large;
+	region->large = chunk;
+	return (void *)(((uintptr_t)chunk_data(chunk) + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+// move on to a chunk with room for size bytes aligned to align, reusing the
+// chunks kept by a reset first, and allocate from it
+static void *region_grow(struct os_arena *region, size_t align, size_t size)
+{
+	size_t need = size + align - REGION_ALIGN;
+
+	if (need > region->chunk_size / 4)
+		return large_alloc(region, align, size);
+
+	struct region_chunk *chunk = region->current->next;
+
+	// a kept chunk too small for this allocation is left for the next reset
+	while (chunk && chunk->size < need)
+		chunk = chunk->next;
+
+	if (!chunk) {
+		chunk = chunk_create(region->chunk_size);
+		if (!chunk)
+			return NULL;
+		if (region->chunk_size < REGION_MAX_CHUNK)
+			region->chunk_size *= 2;
+
+		// after the current chunk, so a reset walks the chunks in the order they filled
+		chunk->next = region->current->next;
+		region->current->next = chunk;
+	}
+
+	region->current = chunk;
+	region->ptr = chunk_data(chunk);
+	region->end = chunk_data(chunk) + chunk->size;
+	return os_arena_aligned_alloc(region, align, size);
+}
+
+void *os_arena_aligned_alloc(struct os_arena *region, size_t align, size_t size)
+{
+	if (!size || size > SIZE_MAX / 2 || !align || (align & (align - 1)))
+		return NULL;
+	if (align < REGION_ALIGN)
+		align = REGION_ALIGN;
+
+	size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+
+	char *ptr = (char *)(((uintptr_t)region->ptr + align - 1) & ~(uintptr_t)(align - 1));
+
+	if (ptr > region->end || size > (size_t)(region->end - ptr))
+		return region_grow(region, align, size);
+
+	region->ptr = ptr + size;
+	return ptr;
+}
+
+void *os_arena_alloc(struct os_arena *region, size_t size)
+{
+	if (!size || size > SIZE_MAX / 2)
+		return NULL;
+
+	size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+
+	// the pointer stays aligned to REGION_ALIGN
+	if (size <= (size_t)(region->end - region->ptr)) {
+		void *ptr = region->ptr;
+
+		region->ptr += size;
+		return ptr;
+	}
+	return region_grow(region, REGION_ALIGN, size);
+}
+
+// free the blocks of the large allocations of a region
+static void large_free(struct os_arena *region)
+{
+	while (region->large) {
+		struct region_chunk *chunk = region->large;
+
+		region->large = chunk->next;
+		do_free(chunk);
+	}
+}
+
+void os_arena_reset(struct os_arena *region)
+{
+	large_free(region);
+	region->current = region->first;
+	region->ptr = chunk_data(region->first) + REGION_HEADER_SIZE;
+	region->end = chunk_data(region->first) + region->first->size;
+}
+
+void os_arena_destroy(struct os_arena *region)
+{
+	if (!region)
+		return;
+
+	large_free(region);
+
+	struct region_chunk *chunk = region->first;
+
+	// the region lives in the first chunk, not looked at once that is freed
+	while (chunk) {
+		struct region_chunk *next = chunk->next;
+
+		do_free(chunk);
+		chunk = next;
+	}
+}
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define SLAB_ZONE_SIZE (4UL << 30)
+#define SLAB_CHUNK (256 * 1024)
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLAB_MIN_SLOT / 64)
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15UL)
+
+/*
+ * A page of equal slots, with no header per object: a set bit in bitmap
+ * marks a slot in use. The page map points the page to the span at the
+ * start of the slab. Slabs with free slots sit on the list of their arena
+ * and size class.
+ */
+struct slab {
+	struct span span;
+	struct slab *next;
+	struct slab *prev;
+	unsigned int slots;
+	unsigned int used;
+	uint64_t bitmap[SLAB_BITMAP_WORDS];
+};
+
+// virtual range reserved for slabs, committed SLAB_CHUNK bytes at a time
+char *slab_zone;
+static size_t zone_used;
+static size_t zone_committed;
+
+// slabs that became empty, shared by all arenas
+static struct slab *empty_slabs;
+pthread_mutex_t zone_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// obtain a slab from the zone, reserving it on first use
+static struct slab *zone_get(void)
+{
+	struct slab *slab = NULL;
+
+	pthread_mutex_lock(&zone_mutex);
+	if (empty_slabs) {
+		slab = empty_slabs;
+		empty_slabs = slab->next;
+		goto out;
+	}
+
+	if (!slab_zone) {
+		char *zone = sys_mmap(NULL, SLAB_ZONE_SIZE, PROT_NONE,
+				      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (zone == MAP_FAILED)
+			goto out;
+		__atomic_store_n(&slab_zone, zone, __ATOMIC_RELEASE);
+	}
+
+	if (zone_used == zone_committed) {
+		if (zone_committed == SLAB_ZONE_SIZE ||
+		    sys_mprotect(slab_zone + zone_committed, SLAB_CHUNK, PROT_READ | PROT_WRITE))
+			goto out;
+		zone_committed += SLAB_CHUNK;
+	}
+
+	slab = (struct slab *)(slab_zone + zone_used);
+	zone_used += SLAB_SIZE;
+out:
+	pthread_mutex_unlock(&zone_mutex);
+	return slab;
+}
+
+// give an empty slab back to the zone, called with its arena locked if it has one
+static void zone_put(struct slab *slab)
+{
+	// no longer counted by slab_stats()
+	__atomic_store_n(&slab->span.arena, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&zone_mutex);
+	slab->next = empty_slabs;
+	empty_slabs = slab;
+	pthread_mutex_unlock(&zone_mutex);
+}
+
+// add a slab to the list of its size class
+static void slab_link(struct arena *arena, size_t index, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = arena->slabs[index];
+	if (slab->next)
+		slab->next->prev = slab;
+	arena->slabs[index] = slab;
+}
+
+// remove a slab from the list of its size class
+static void slab_unlink(struct arena *arena, size_t index, struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		arena->slabs[index] = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+// set up a new slab of slot_size slots
+static struct slab *slab_create(struct arena *arena, size_t slot_size)
+{
+	struct slab *slab = zone_get();
+
+	if (!slab)
+		return NULL;
+
+	slab->span.arena = arena;
+	slab->span.kind = SPAN_SLAB;
+	slab->span.size_class = slot_size;
+	if (page_map_set(slab, SLAB_SIZE, &slab->span)) {
+		zone_put(slab);
+		return NULL;
+	}
+
+	slab->slots = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size;
+	slab->used = 0;
+	for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++)
+		slab->bitmap[i] = 0;
+	return slab;
+}
+
+// allocate a slot of at least size bytes, called with the arena locked
+void *slab_malloc(struct arena *arena, size_t size)
+{
+	remote_drain(arena);
+
+	size_t index = slab_class(size);
+	struct slab *slab = arena->slabs[index];
+
+	if (!slab) {
+		slab = slab_create(arena, (index + 1) * SLAB_MIN_SLOT);
+		if (!slab)
+			return NULL;
+		slab_link(arena, index, slab);
+	}
+
+	size_t word = 0;
+
+	while (!~slab->bitmap[word])
+		word++;
+
+	size_t slot = word * 64 + __builtin_ctzl(~slab->bitmap[word]);
+
+	slab->bitmap[word] |= 1UL << (slot % 64);
+	if (++slab->used == slab->slots)
+		slab_unlink(arena, index, slab);
+
+	return (char *)slab + SLAB_HEADER_SIZE + slot * slab->span.size_class;
+}
+
+// free a slot of the slab with the given span, called with its arena locked
+void slab_free_locked(struct span *span, void *ptr)
+{
+	struct slab *slab = (struct slab *)span;
+	struct arena *arena = span->arena;
+	size_t slot = ((char *)ptr - (char *)slab - SLAB_HEADER_SIZE) / span->size_class;
+	size_t index = slab_class(span->size_class);
+
+	if (!(slab->bitmap[slot / 64] & (1UL << (slot % 64))))
+		return; // double free
+
+	slab->bitmap[slot / 64] &= ~(1UL << (slot % 64));
+	if (slab->used-- == slab->slots)
+		slab_link(arena, index, slab);
+
+	if (!slab->used && (slab->prev || slab->next)) {
+		// keep one slab per class, give the other empty ones back
+		slab_unlink(arena, index, slab);
+		zone_put(slab);
+	}
+}
+
+// free a slot of the slab with the given span
+void slab_free(struct span *span, void *ptr)
+{
+	struct arena *arena = span->arena;
+
+	arena_lock(arena);
+	slab_free_locked(span, ptr);
+	arena_unlock(arena);
+}
+
+// add the slabs handed out so far to stats, locking the arena of each
+void slab_stats(struct os_malloc_stats *stats)
+{
+	pthread_mutex_lock(&zone_mutex);
+	size_t used = zone_used;
+	pthread_mutex_unlock(&zone_mutex);
+
+	for (size_t offset = 0; offset < used; offset += SLAB_SIZE) {
+		struct slab *slab = (struct slab *)(slab_zone + offset);
+		struct arena *arena = __atomic_load_n(&slab->span.arena, __ATOMIC_RELAXED);
+
+		// a slab handed out but not set up yet has no arena
+		if (!arena)
+			continue;
+
+		// a slab given back may be taken by another arena meanwhile
+		arena_lock(arena);
+		if (slab->span.arena == arena) {
+			size_t slot_size = slab->span.size_class;
+
+			stats->slab_size += SLAB_SIZE;
+			stats->slab_free += (slab->slots - slab->used) * slot_size;
+			stats->in_use += slab->used * slot_size;
+			stats->used_blocks[stats_class(slot_size)] += slab->used;
+		}
+		arena_unlock(arena);
+	}
+}
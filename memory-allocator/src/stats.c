@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include "printf.h"
+#include "osmem.h"
+#include "heap.h"
+
+struct counters counters;
+
+// count a system call
+static inline void count(unsigned long *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+void *sys_sbrk(intptr_t increment)
+{
+	count(&counters.sbrk);
+	return sbrk(increment);
+}
+
+void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, long offset)
+{
+	count(&counters.mmap);
+	return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int sys_munmap(void *addr, size_t length)
+{
+	count(&counters.munmap);
+	return munmap(addr, length);
+}
+
+void *sys_mremap(void *addr, size_t old_length, size_t new_length, int flags)
+{
+	count(&counters.mremap);
+	return mremap(addr, old_length, new_length, flags);
+}
+
+int sys_madvise(void *addr, size_t length, int advice)
+{
+	count(&counters.madvise);
+	return madvise(addr, length, advice);
+}
+
+// committing slab pages counts as mapping them
+int sys_mprotect(void *addr, size_t length, int prot)
+{
+	count(&counters.mmap);
+	return mprotect(addr, length, prot);
+}
+
+// obtain the size class of a block in the stats, for blocks of up to 16 << class bytes
+int stats_class(size_t size)
+{
+	int class = size <= 16 ? 0 : 64 - __builtin_clzl(size - 1) - 4;
+
+	return class < OS_STATS_CLASSES ? class : OS_STATS_CLASSES - 1;
+}
+
+// add the blocks of a list to stats, from block to the end of the list
+static void walk_blocks(struct block_meta *block, struct os_malloc_stats *stats, size_t *size, size_t *free)
+{
+	for (; block; block = block->next) {
+		*size += block->size + BLOCK_SIZE;
+		if (block->status == STATUS_FREE) {
+			*free += block->size;
+			stats->free_blocks[stats_class(block->size)]++;
+			if (block->size > stats->largest_free)
+				stats->largest_free = block->size;
+		} else if (block->status == STATUS_CACHED) {
+			stats->thread_cached += block->size;
+		} else {
+			stats->in_use += block->size;
+			stats->used_blocks[stats_class(block->size)]++;
+		}
+	}
+}
+
+// add the segments of a run of pages of an mmap backed arena to stats
+static void walk_segments(char *start, size_t size, struct span *span, void *arg)
+{
+	struct os_malloc_stats *stats = arg;
+	struct arena *arena = span->arena;
+
+	if (span->kind != SPAN_HEAP || arena == &arenas[0])
+		return;
+
+	arena_lock(arena);
+	// segments may have been unmapped since the run was seen
+	for (char *segment = start; segment < start + size && page_span(segment) == span; segment += SEGMENT_SIZE)
+		walk_blocks((struct block_meta *)segment, stats, &stats->segment_size, &stats->segment_free);
+	arena_unlock(arena);
+}
+
+void os_malloc_stats(struct os_malloc_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	// blocks waiting on remote lists are free already
+	for (int i = 0; i < __atomic_load_n(&arenas_used, __ATOMIC_RELAXED); i++) {
+		arena_lock(&arenas[i]);
+		remote_drain(&arenas[i]);
+		arena_unlock(&arenas[i]);
+	}
+
+	arena_lock(&arenas[0]);
+	walk_blocks(arenas[0].base, stats, &stats->sbrk_size, &stats->sbrk_free);
+	arena_unlock(&arenas[0]);
+	page_map_walk(walk_segments, stats);
+	slab_stats(stats);
+
+	stats->mapped = __atomic_load_n(&counters.mapped, __ATOMIC_RELAXED);
+	stats->mapped_blocks = __atomic_load_n(&counters.mapped_blocks, __ATOMIC_RELAXED);
+	stats->in_use += stats->mapped;
+	stats->large_cached = large_cache_size();
+	stats->mmap_threshold = mmap_threshold();
+
+	size_t free = stats->sbrk_free + stats->segment_free;
+
+	stats->fragmentation = free ? 1.0 - (double)stats->largest_free / free : 0;
+
+	stats->sbrk_calls = __atomic_load_n(&counters.sbrk, __ATOMIC_RELAXED);
+	stats->mmap_calls = __atomic_load_n(&counters.mmap, __ATOMIC_RELAXED);
+	stats->munmap_calls = __atomic_load_n(&counters.munmap, __ATOMIC_RELAXED);
+	stats->mremap_calls = __atomic_load_n(&counters.mremap, __ATOMIC_RELAXED);
+	stats->madvise_calls = __atomic_load_n(&counters.madvise, __ATOMIC_RELAXED);
+}
+
+void dump_flush(struct dump *dump)
+{
+	size_t done = 0;
+
+	while (done < dump->len) {
+		ssize_t ret = write(dump->fd, dump->buf + done, dump->len - done);
+
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	dump->len = 0;
+}
+
+void dump_char(char character, void *arg)
+{
+	struct dump *dump = arg;
+
+	dump->buf[dump->len++] = character;
+	if (dump->len == DUMP_BUFFER)
+		dump_flush(dump);
+}
+
+void os_malloc_stats_print(int fd)
+{
+	struct os_malloc_stats stats;
+	struct os_arena_stats arena_stats[MAX_ARENAS];
+	struct dump dump = { .fd = fd };
+
+	os_malloc_stats(&stats);
+	int used = os_malloc_arena_stats(arena_stats, MAX_ARENAS);
+
+	fctprintf(dump_char, &dump, "in use:        %zu bytes\n", stats.in_use);
+	fctprintf(dump_char, &dump, "sbrk heap:     %zu bytes, %zu free\n", stats.sbrk_size, stats.sbrk_free);
+	fctprintf(dump_char, &dump, "segments:      %zu bytes, %zu free\n", stats.segment_size, stats.segment_free);
+	fctprintf(dump_char, &dump, "largest free:  %zu bytes, fragmentation %.3f\n",
+		  stats.largest_free, stats.fragmentation);
+	fctprintf(dump_char, &dump, "thread caches: %zu bytes\n", stats.thread_cached);
+	fctprintf(dump_char, &dump, "slabs:         %zu bytes, %zu free\n", stats.slab_size, stats.slab_free);
+	fctprintf(dump_char, &dump, "mmap'd:        %zu bytes in %zu blocks, %zu cached\n",
+		  stats.mapped, stats.mapped_blocks, stats.large_cached);
+	fctprintf(dump_char, &dump, "mmap threshold: %zu bytes\n", stats.mmap_threshold);
+	fctprintf(dump_char, &dump, "system calls:  sbrk %lu, mmap %lu, munmap %lu, mremap %lu, madvise %lu\n",
+		  stats.sbrk_calls, stats.mmap_calls, stats.munmap_calls, stats.mremap_calls, stats.madvise_calls);
+
+	fctprintf(dump_char, &dump, "size class     used blocks  free blocks\n");
+	for (int i = 0; i < OS_STATS_CLASSES; i++)
+		if (stats.used_blocks[i] || stats.free_blocks[i])
+			fctprintf(dump_char, &dump, "%2s %-10zu  %11lu  %11lu\n", i == OS_STATS_CLASSES - 1 ? ">" : "<=",
+				  i == OS_STATS_CLASSES - 1 ? (size_t)16 << (i - 1) : (size_t)16 << i,
+				  stats.used_blocks[i], stats.free_blocks[i]);
+
+	for (int i = 0; i < used; i++)
+		fctprintf(dump_char, &dump,
+			  "arena %-2d:      %d threads, %zu segments, %lu locks, %lu contended, %lu remote frees\n",
+			  i, arena_stats[i].threads, arena_stats[i].segments, arena_stats[i].lock_acquisitions,
+			  arena_stats[i].lock_contentions, arena_stats[i].remote_frees);
+	dump_flush(&dump);
+}
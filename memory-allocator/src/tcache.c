@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_BINS (TCACHE_MAX_SIZE / N_ALIGN_N)
+#define TCACHE_DEAD (-1)
+
+// per thread stacks of freed blocks, one per payload size; a cached block
+// keeps STATUS_CACHED and links to the next one through its payload
+struct tcache {
+	struct block_meta *entries[TCACHE_BINS];
+	unsigned int counts[TCACHE_BINS];
+	int state;
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+// obtain the cached block that follows block
+static inline struct block_meta **next_cached(struct block_meta *block)
+{
+	return (struct block_meta **)(block + 1);
+}
+
+// return count blocks of a bin to their arenas
+static void tcache_flush(size_t index, unsigned int count)
+{
+	struct arena *locked = NULL;
+
+	while (count-- && tcache.entries[index]) {
+		struct block_meta *block = tcache.entries[index];
+		struct arena *arena = arena_of(block);
+
+		// blocks freed by this thread may come from any arena
+		if (arena != locked) {
+			if (locked)
+				arena_unlock(locked);
+			arena_lock(arena);
+			locked = arena;
+		}
+
+		tcache.entries[index] = *next_cached(block);
+		tcache.counts[index]--;
+		heap_free(arena, block);
+	}
+	if (locked)
+		arena_unlock(locked);
+}
+
+// return the whole cache of an exiting thread to the arenas
+void tcache_destroy(void)
+{
+	for (size_t i = 0; i < TCACHE_BINS; i++)
+		tcache_flush(i, tcache.counts[i]);
+	tcache.state = TCACHE_DEAD;
+}
+
+// check if the calling thread should use its cache
+int tcache_enabled(void)
+{
+	int multi = threads_multi();
+
+	if (tcache.state == TCACHE_DEAD)
+		return 0;
+
+	int mode = tunable(OS_M_TCACHE);
+
+	if (!mode || (mode < 0 && !multi))
+		return 0;
+
+	if (!tcache.state) {
+		// flush the cache when the thread exits
+		thread_register();
+		tcache.state = 1;
+	}
+	return 1;
+}
+
+// obtain a cached block of size bytes, refilling its bin from arena in one batch
+void *tcache_get(struct arena *arena, size_t size)
+{
+	size_t index = size / N_ALIGN_N;
+
+	if (index >= TCACHE_BINS)
+		return NULL;
+
+	if (!tcache.entries[index]) {
+		void *ptrs[TCACHE_BINS];
+		unsigned int count = (tunable(OS_M_TCACHE_COUNT) + 1) / 2;
+
+		if (!count)
+			return NULL;
+		if (count > TCACHE_BINS)
+			count = TCACHE_BINS;
+
+		arena_lock(arena);
+		count = heap_malloc_run(arena, size, count, ptrs);
+		arena_unlock(arena);
+
+		for (unsigned int i = 0; i < count; i++) {
+			struct block_meta *block = (struct block_meta *)ptrs[i] - 1;
+
+			block->status = STATUS_CACHED;
+			*next_cached(block) = tcache.entries[index];
+			tcache.entries[index] = block;
+		}
+		tcache.counts[index] += count;
+	}
+
+	struct block_meta *block = tcache.entries[index];
+
+	if (!block)
+		return NULL;
+
+	tcache.entries[index] = *next_cached(block);
+	tcache.counts[index]--;
+	block->status = STATUS_ALLOC;
+	return block + 1;
+}
+
+// keep a freed heap block in the cache of the calling thread
+int tcache_put(struct block_meta *block)
+{
+	size_t index = block->size / N_ALIGN_N;
+	unsigned int limit = tunable(OS_M_TCACHE_COUNT);
+
+	if (index >= TCACHE_BINS || !limit)
+		return 0;
+
+	if (tcache.counts[index] >= limit)
+		tcache_flush(index, (tcache.counts[index] + 1) / 2);
+
+	block->status = STATUS_CACHED;
+	*next_cached(block) = tcache.entries[index];
+	tcache.entries[index] = block;
+	tcache.counts[index]++;
+	return 1;
+}
@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define TRACE_RECORDS 1024
+#define TRACE_OPENING (-2)
+
+/*
+ * Trace recorder: every call into the os_* API appends an os_trace_record
+ * to a buffer of the calling thread, written out to the trace file when it
+ * fills up, when the thread exits and when the trace stops. Records of
+ * different threads land in the file out of order; their timestamps order
+ * them again.
+ */
+
+// records of one thread not written yet
+struct trace_buffer {
+	struct trace_buffer *next;	/* in the list of all buffers */
+	int lock;			/* taken by the owner to append, by others to flush */
+	int owned;
+	unsigned int epoch;		/* trace the records belong to */
+	uint32_t thread;
+	size_t count;
+	struct os_trace_record records[TRACE_RECORDS];
+};
+
+int tracing;
+static int trace_fd = -1;			/* TRACE_OPENING while a start opens the file */
+static unsigned int trace_epoch;
+static unsigned long trace_start;
+static uint32_t trace_threads;
+static struct trace_buffer *trace_buffers;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static __thread struct trace_buffer *my_trace __attribute__((tls_model("initial-exec")));
+
+static inline void buffer_lock(struct trace_buffer *buffer)
+{
+	while (__atomic_exchange_n(&buffer->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static inline void buffer_unlock(struct trace_buffer *buffer)
+{
+	__atomic_store_n(&buffer->lock, 0, __ATOMIC_RELEASE);
+}
+
+// write the records of a buffer to the trace, called with the buffer locked and trace_mutex held
+static void buffer_flush(struct trace_buffer *buffer)
+{
+	char *data = (char *)buffer->records;
+	size_t left = buffer->count * sizeof(struct os_trace_record);
+
+	// records left from a trace stopped meanwhile are dropped
+	if (buffer->epoch == trace_epoch && trace_fd >= 0) {
+		while (left) {
+			ssize_t ret = write(trace_fd, data, left);
+
+			if (ret <= 0)
+				break;
+			data += ret;
+			left -= ret;
+		}
+	}
+	buffer->count = 0;
+	buffer->epoch = trace_epoch;
+}
+
+// write the records of a buffer to the trace, called with the buffer locked
+static inline void buffer_write(struct trace_buffer *buffer)
+{
+	pthread_mutex_lock(&trace_mutex);
+	buffer_flush(buffer);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+// obtain the buffer of the calling thread, taking one over from an exited thread if there is any
+static struct trace_buffer *trace_buffer(void)
+{
+	struct trace_buffer *buffer;
+
+	pthread_mutex_lock(&trace_mutex);
+	for (buffer = trace_buffers; buffer; buffer = buffer->next)
+		if (!buffer->owned)
+			break;
+
+	if (!buffer) {
+		buffer = mmap(NULL, sizeof(*buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			pthread_mutex_unlock(&trace_mutex);
+			return NULL;
+		}
+		buffer->epoch = trace_epoch;
+		buffer->next = trace_buffers;
+		trace_buffers = buffer;
+	}
+	buffer->owned = 1;
+	buffer->thread = trace_threads++;
+	pthread_mutex_unlock(&trace_mutex);
+
+	// have the buffer written out and given back when the thread exits
+	thread_register();
+	return buffer;
+}
+
+void trace_record(uint32_t op, unsigned long start, const void *ptr, size_t size, const void *result)
+{
+	unsigned long now = trace_now();
+	struct trace_buffer *buffer = my_trace;
+
+	if (!buffer) {
+		buffer = my_trace = trace_buffer();
+		if (!buffer)
+			return;
+	}
+
+	buffer_lock(buffer);
+	if (buffer->epoch != __atomic_load_n(&trace_epoch, __ATOMIC_RELAXED) || buffer->count == TRACE_RECORDS)
+		buffer_write(buffer);
+
+	struct os_trace_record *record = &buffer->records[buffer->count++];
+
+	// a call that started before the trace did is taken to have started with it
+	record->start = start > trace_start ? start - trace_start : 0;
+	record->end = now - trace_start;
+	record->thread = buffer->thread;
+	record->op = op;
+	record->ptr = (uintptr_t)ptr;
+	record->size = size;
+	record->result = (uintptr_t)result;
+	buffer_unlock(buffer);
+}
+
+// write out the buffer of an exiting thread and leave it to the next thread
+void trace_thread_exit(void)
+{
+	struct trace_buffer *buffer = my_trace;
+
+	if (!buffer)
+		return;
+
+	buffer_lock(buffer);
+	buffer_write(buffer);
+	buffer_unlock(buffer);
+	pthread_mutex_lock(&trace_mutex);
+	buffer->owned = 0;
+	pthread_mutex_unlock(&trace_mutex);
+	my_trace = NULL;
+}
+
+static void trace_exit(void)
+{
+	os_malloc_trace_stop();
+}
+
+static void trace_init(void)
+{
+	atexit(trace_exit);
+}
+
+int os_malloc_trace_start(const char *path)
+{
+	struct os_trace_header header = { .magic = OS_TRACE_MAGIC, .version = OS_TRACE_VERSION,
+					  .record_size = sizeof(struct os_trace_record) };
+
+	pthread_once(&trace_once, trace_init);
+
+	// claim the trace before the file is opened, which truncates it
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fd != -1) {
+		pthread_mutex_unlock(&trace_mutex);
+		errno = EBUSY;
+		return -1;
+	}
+	trace_fd = TRACE_OPENING;
+	pthread_mutex_unlock(&trace_mutex);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if (fd >= 0 && write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		fd = -1;
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+	trace_fd = fd;
+	if (fd < 0) {
+		pthread_mutex_unlock(&trace_mutex);
+		return -1;
+	}
+	trace_start = trace_now();
+	// records left in the buffers from before belong to no trace
+	__atomic_fetch_add(&trace_epoch, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_mutex);
+	return 0;
+}
+
+void os_malloc_trace_stop(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+	if (!tracing) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+
+	// buffers are only ever added to the front of the list
+	struct trace_buffer *buffers = trace_buffers;
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	// owners append with their buffer locked first, then trace_mutex
+	for (struct trace_buffer *buffer = buffers; buffer; buffer = buffer->next) {
+		buffer_lock(buffer);
+		buffer_write(buffer);
+		buffer_unlock(buffer);
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+	close(trace_fd);
+	trace_fd = -1;
+	__atomic_fetch_add(&trace_epoch, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+// the child of a fork() does not write to the trace of its parent
+void trace_fork_child(void)
+{
+	pthread_mutex_init(&trace_mutex, NULL);
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+	tracing = 0;
+	trace_epoch++;
+}
+
+// start the trace named by OSMEM_TRACE, on the first call into the allocator
+void trace_env(void)
+{
+	char *path = getenv("OSMEM_TRACE");
+
+	if (path && *path)
+		os_malloc_trace_start(path);
+}
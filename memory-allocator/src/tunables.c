@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <limits.h>
+#include "osmem.h"
+#include "heap.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct tunable {
+	const char *env;
+	int value;
+	int min;
+	int max;
+};
+
+static struct tunable tunables[] = {
+	[OS_M_TCACHE] = { "OSMEM_TCACHE", -1, -1, 1 },
+	[OS_M_TCACHE_COUNT] = { "OSMEM_TCACHE_COUNT", 32, 0, 4096 },
+	[OS_M_ARENAS] = { "OSMEM_ARENAS", 0, 0, MAX_ARENAS },
+	[OS_M_SLAB] = { "OSMEM_SLAB", 0, 0, 1 },
+	[OS_M_LARGE_CACHE] = { "OSMEM_LARGE_CACHE", 0, 0, INT_MAX },
+	[OS_M_LARGE_DECAY] = { "OSMEM_LARGE_DECAY", 1000, 0, INT_MAX },
+	[OS_M_MREMAP] = { "OSMEM_MREMAP", 0, 0, 1 },
+	[OS_M_TRIM_THRESHOLD] = { "OSMEM_TRIM_THRESHOLD", -1, -1, INT_MAX },
+	[OS_M_MADV_FREE] = { "OSMEM_MADV_FREE", 0, 0, 1 },
+	[OS_M_PURGE_INTERVAL] = { "OSMEM_PURGE_INTERVAL", 0, 0, INT_MAX },
+	[OS_M_DIRTY_DECAY] = { "OSMEM_DIRTY_DECAY", 1000, 0, INT_MAX },
+	[OS_M_MUZZY_DECAY] = { "OSMEM_MUZZY_DECAY", 0, 0, INT_MAX },
+	[OS_M_HUGEPAGE] = { "OSMEM_HUGEPAGE", 0, 0, 2 },
+	[OS_M_PROF_SAMPLE] = { "OSMEM_PROF_SAMPLE", 0, 0, INT_MAX },
+	[OS_M_PROF_SIGNAL] = { "OSMEM_PROF_SIGNAL", 0, 0, 64 },
+	[OS_M_REMOTE_FREE] = { "OSMEM_REMOTE_FREE", 0, 0, 1 },
+	[OS_M_POOL_MAGAZINE] = { "OSMEM_POOL_MAGAZINE", 0, 0, 4096 },
+	[OS_M_MMAP_THRESHOLD] = { "OSMEM_MMAP_THRESHOLD", MMAP_THRESHOLD, 0, MMAP_THRESHOLD_MAX },
+	[OS_M_MMAP_DYNAMIC] = { "OSMEM_MMAP_DYNAMIC", 0, 0, 1 },
+	[OS_M_HEAP_GROWTH] = { "OSMEM_HEAP_GROWTH", 0, 0, INT_MAX },
+};
+
+static pthread_once_t tunables_once = PTHREAD_ONCE_INIT;
+
+// set a tunable; the thresholds, once set, are no longer adjusted by
+// OS_M_MMAP_DYNAMIC, unless that is set again
+static void tunable_set(int param, int value)
+{
+	if (param == OS_M_MMAP_THRESHOLD || param == OS_M_TRIM_THRESHOLD)
+		__atomic_store_n(&tunables[OS_M_MMAP_DYNAMIC].value, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&tunables[param].value, value, __ATOMIC_RELAXED);
+}
+
+// set a tunable from its environment variable, if that holds a valid value
+static void read_var(int param)
+{
+	char *env = getenv(tunables[param].env);
+	char *end;
+
+	if (!env || !*env)
+		return;
+
+	long value = strtol(env, &end, 0);
+
+	if (!*end && value >= tunables[param].min && value <= tunables[param].max)
+		tunable_set(param, value);
+}
+
+// read the tunables from the environment; OSMEM_MMAP_DYNAMIC goes last, so
+// setting it along with a threshold keeps the dynamic threshold on
+static void read_env(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(tunables); i++)
+		if (i != OS_M_MMAP_DYNAMIC)
+			read_var(i);
+	read_var(OS_M_MMAP_DYNAMIC);
+}
+
+// read the environment once, on the first call into the allocator
+void tunables_init(void)
+{
+	pthread_once(&tunables_once, read_env);
+}
+
+// obtain the value of a tunable
+int tunable(int param)
+{
+	return tunables[param].value;
+}
+
+// raise a tunable to value, leaving it alone if it is that high already
+void tunable_raise(int param, int value)
+{
+	int old = __atomic_load_n(&tunables[param].value, __ATOMIC_RELAXED);
+
+	while (old < value && !__atomic_compare_exchange_n(&tunables[param].value, &old, value, 0,
+							   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+int os_mallopt(int param, int value)
+{
+	tunables_init();
+
+	if (param < 0 || (size_t)param >= ARRAY_SIZE(tunables))
+		return 0;
+	if (value < tunables[param].min || value > tunables[param].max)
+		return 0;
+
+	tunable_set(param, value);
+	return 1;
+}
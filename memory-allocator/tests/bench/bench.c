@@ -0,0 +1,525 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Throughput, latency and memory benchmarks of libosmem against the malloc
+ * of glibc. Every workload runs in a child process of its own per
+ * allocator, so the peak RSS it reports (VmHWM) is its own. One operation
+ * in LAT_EVERY is timed on its own for the latency percentiles.
+ *
+ *	bench [-a osmem|glibc] [-t threads] [-n ops] [workload...]
+ *
+ * with the workloads random, larson, prodcons, realloc and frag, all of them
+ * by default; ops are per thread.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "osmem.h"
+
+#define LAT_EVERY 8
+#define MAX_THREADS 64
+#define SLOTS 1000
+#define LARSON_ROUNDS 10
+#define RING_SIZE 1024
+#define FRAG_OBJECTS 20000
+#define REALLOC_MAX (1 << 20)
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+};
+
+struct allocator allocators[] = {
+	{ "osmem", os_malloc, os_free, os_realloc },
+	{ "glibc", malloc, free, realloc },
+};
+
+// latencies timed by one thread, in a buffer that does not come from the allocators
+struct thread_lat {
+	unsigned int *ns;
+	size_t count;
+	size_t capacity;
+	unsigned long ops;
+	unsigned long rng;
+};
+
+// what a child reports to the parent
+struct result {
+	unsigned long ops;
+	double seconds;
+	unsigned int p50, p99, p999, max;
+	long hwm_kib;
+};
+
+struct bench {
+	const struct allocator *alloc;
+	int threads;
+	unsigned long ops;
+	struct thread_lat lat[MAX_THREADS];
+};
+
+struct workload {
+	const char *name;
+	void (*run)(struct bench *bench);
+};
+
+struct bench bench;
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long next_rand(struct thread_lat *lat)
+{
+	unsigned long x = lat->rng;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	lat->rng = x;
+	return x;
+}
+
+// draw a size: mostly small, some up to a few KiB, a few up to 64 KiB
+static inline size_t random_size(struct thread_lat *lat)
+{
+	unsigned long x = next_rand(lat);
+
+	switch (x & 15) {
+	case 0:
+		return (x >> 8) % 65536 + 1;
+	case 1:
+	case 2:
+	case 3:
+		return (x >> 8) % 4096 + 1;
+	default:
+		return (x >> 8) % 256 + 8;
+	}
+}
+
+static inline void record(struct thread_lat *lat, unsigned long start)
+{
+	if (lat->count < lat->capacity)
+		lat->ns[lat->count++] = now_ns() - start;
+}
+
+// allocate through the benchmarked allocator, timing one call in LAT_EVERY
+static inline void *timed_malloc(struct thread_lat *lat, size_t size)
+{
+	void *ptr;
+
+	if (lat->ops++ % LAT_EVERY)
+		return bench.alloc->malloc(size);
+
+	unsigned long start = now_ns();
+
+	ptr = bench.alloc->malloc(size);
+	record(lat, start);
+	return ptr;
+}
+
+static inline void timed_free(struct thread_lat *lat, void *ptr)
+{
+	if (lat->ops++ % LAT_EVERY) {
+		bench.alloc->free(ptr);
+		return;
+	}
+
+	unsigned long start = now_ns();
+
+	bench.alloc->free(ptr);
+	record(lat, start);
+}
+
+static inline void *timed_realloc(struct thread_lat *lat, void *ptr, size_t size)
+{
+	if (lat->ops++ % LAT_EVERY)
+		return bench.alloc->realloc(ptr, size);
+
+	unsigned long start = now_ns();
+
+	ptr = bench.alloc->realloc(ptr, size);
+	record(lat, start);
+	return ptr;
+}
+
+// touch an allocation, as a program would
+static inline void touch(void *ptr, size_t size)
+{
+	((char *)ptr)[0] = 1;
+	((char *)ptr)[size - 1] = 1;
+}
+
+// run fn on every thread at once, passing each its index
+void run_threads(int count, void *(*fn)(void *))
+{
+	pthread_t threads[MAX_THREADS];
+
+	for (long i = 0; i < count; i++)
+		pthread_create(&threads[i], NULL, fn, (void *)i);
+	for (int i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+// malloc or free a random slot, of random size
+void *random_thread(void *arg)
+{
+	struct thread_lat *lat = &bench.lat[(long)arg];
+	void *slots[SLOTS] = { NULL };
+
+	for (unsigned long i = 0; i < bench.ops; i++) {
+		unsigned long slot = next_rand(lat) % SLOTS;
+
+		if (slots[slot]) {
+			timed_free(lat, slots[slot]);
+			slots[slot] = NULL;
+		} else {
+			size_t size = random_size(lat);
+
+			slots[slot] = timed_malloc(lat, size);
+			touch(slots[slot], size);
+		}
+	}
+	for (int i = 0; i < SLOTS; i++)
+		if (slots[i])
+			bench.alloc->free(slots[i]);
+	return NULL;
+}
+
+void run_random(struct bench *bench)
+{
+	run_threads(bench->threads, random_thread);
+}
+
+// larson: each round, every thread replaces random objects of the array it
+// was handed, which the thread of the previous round filled
+void *larson_slots[MAX_THREADS][SLOTS];
+int larson_round;
+
+void *larson_thread(void *arg)
+{
+	long index = (long)arg;
+	struct thread_lat *lat = &bench.lat[index];
+	void **slots = larson_slots[(index + larson_round) % bench.threads];
+
+	for (unsigned long i = 0; i < bench.ops / LARSON_ROUNDS; i++) {
+		unsigned long slot = next_rand(lat) % SLOTS;
+		size_t size = next_rand(lat) % 500 + 10;
+
+		if (slots[slot])
+			timed_free(lat, slots[slot]);
+		slots[slot] = timed_malloc(lat, size);
+		touch(slots[slot], size);
+	}
+	return NULL;
+}
+
+void run_larson(struct bench *bench)
+{
+	for (larson_round = 0; larson_round < LARSON_ROUNDS; larson_round++)
+		run_threads(bench->threads, larson_thread);
+
+	for (int i = 0; i < bench->threads; i++)
+		for (int j = 0; j < SLOTS; j++)
+			if (larson_slots[i][j])
+				bench->alloc->free(larson_slots[i][j]);
+}
+
+// producer/consumer pairs: even threads allocate, odd ones free what their
+// producer passes them through a single producer, single consumer ring
+struct ring {
+	void *slots[RING_SIZE];
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+};
+
+struct ring rings[MAX_THREADS / 2];
+
+void *prodcons_thread(void *arg)
+{
+	long index = (long)arg;
+	struct thread_lat *lat = &bench.lat[index];
+	struct ring *ring = &rings[index / 2];
+
+	for (unsigned long i = 0; i < bench.ops; i++) {
+		if (index % 2 == 0) {
+			size_t size = random_size(lat);
+			void *ptr = timed_malloc(lat, size);
+
+			touch(ptr, size);
+			while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+				sched_yield();
+			ring->slots[ring->head % RING_SIZE] = ptr;
+			__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		} else {
+			while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+				sched_yield();
+			timed_free(lat, ring->slots[ring->tail % RING_SIZE]);
+			__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+// obtain the threads of a prodcons run, an even number
+int prodcons_threads(struct bench *bench)
+{
+	return bench->threads < 2 ? 2 : bench->threads & ~1;
+}
+
+void run_prodcons(struct bench *bench)
+{
+	run_threads(prodcons_threads(bench), prodcons_thread);
+}
+
+// grow buffers by half their size at a time up to REALLOC_MAX, then start over
+void *realloc_thread(void *arg)
+{
+	struct thread_lat *lat = &bench.lat[(long)arg];
+	size_t size = 16;
+	void *ptr = bench.alloc->malloc(size);
+
+	for (unsigned long i = 0; i < bench.ops; i++) {
+		if (size >= REALLOC_MAX) {
+			bench.alloc->free(ptr);
+			size = 16;
+			ptr = bench.alloc->malloc(size);
+		}
+		size += size / 2 + next_rand(lat) % 64;
+		ptr = timed_realloc(lat, ptr, size);
+		touch(ptr, size);
+	}
+	bench.alloc->free(ptr);
+	return NULL;
+}
+
+void run_realloc(struct bench *bench)
+{
+	run_threads(bench->threads, realloc_thread);
+}
+
+// leave small holes everywhere, then ask for blocks too large for them
+void *frag_thread(void *arg)
+{
+	struct thread_lat *lat = &bench.lat[(long)arg];
+	void **objects = mmap(NULL, FRAG_OBJECTS * sizeof(void *), PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	unsigned long done = 0;
+
+	while (done < bench.ops) {
+		for (int i = 0; i < FRAG_OBJECTS; i++) {
+			size_t size = next_rand(lat) % 4096 + 16;
+
+			objects[i] = timed_malloc(lat, size);
+			touch(objects[i], size);
+		}
+		for (int i = 0; i < FRAG_OBJECTS; i += 2)
+			timed_free(lat, objects[i]);
+		for (int i = 0; i < FRAG_OBJECTS; i += 2) {
+			size_t size = next_rand(lat) % 4096 + 4097;
+
+			objects[i] = timed_malloc(lat, size);
+			touch(objects[i], size);
+		}
+		for (int i = 0; i < FRAG_OBJECTS; i++)
+			timed_free(lat, objects[i]);
+		done += FRAG_OBJECTS * 3;
+	}
+	munmap(objects, FRAG_OBJECTS * sizeof(void *));
+	return NULL;
+}
+
+void run_frag(struct bench *bench)
+{
+	run_threads(bench->threads, frag_thread);
+}
+
+struct workload workloads[] = {
+	{ "random", run_random },
+	{ "larson", run_larson },
+	{ "prodcons", run_prodcons },
+	{ "realloc", run_realloc },
+	{ "frag", run_frag },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// obtain the peak RSS of the process, in KiB
+long peak_rss(void)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	char *line = strstr(buf, "VmHWM:");
+
+	return line ? atol(line + 6) : 0;
+}
+
+int compare_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// run a workload in this process and gather what it did
+void measure(const struct workload *workload, struct result *result)
+{
+	size_t capacity = bench.ops / LAT_EVERY * 2 + 16, total = 0;
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		struct thread_lat *lat = &bench.lat[i];
+
+		lat->ns = mmap(NULL, capacity * sizeof(unsigned int), PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		lat->capacity = lat->ns == MAP_FAILED ? 0 : capacity;
+		lat->count = 0;
+		lat->ops = 0;
+		lat->rng = 0x9e3779b97f4a7c15UL * (i + 1);
+	}
+
+	unsigned long start = now_ns();
+
+	workload->run(&bench);
+	result->seconds = (now_ns() - start) / 1e9;
+	result->hwm_kib = peak_rss();
+
+	result->ops = 0;
+	for (int i = 0; i < MAX_THREADS; i++) {
+		result->ops += bench.lat[i].ops;
+		total += bench.lat[i].count;
+	}
+
+	// the latencies of all threads together
+	unsigned int *all = mmap(NULL, (total + 1) * sizeof(unsigned int), PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	size_t count = 0;
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		memcpy(all + count, bench.lat[i].ns, bench.lat[i].count * sizeof(unsigned int));
+		count += bench.lat[i].count;
+	}
+	qsort(all, count, sizeof(unsigned int), compare_uint);
+	if (count) {
+		result->p50 = all[count / 2];
+		result->p99 = all[count * 99 / 100];
+		result->p999 = all[count * 999 / 1000];
+		result->max = all[count - 1];
+	}
+}
+
+// run a workload in a child process, so that nothing it leaves behind counts for the next one
+int run_child(const struct workload *workload, const struct allocator *alloc, struct result *result)
+{
+	int fds[2];
+
+	if (pipe(fds))
+		return -1;
+
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		close(fds[0]);
+		bench.alloc = alloc;
+		measure(workload, result);
+		if (write(fds[1], result, sizeof(*result)) != sizeof(*result))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	ssize_t len = read(fds[0], result, sizeof(*result));
+	int status;
+
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return len == sizeof(*result) && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+void usage(const char *name)
+{
+	printf("usage: %s [-a osmem|glibc] [-t threads] [-n ops per thread] [workload...]\n", name);
+	printf("workloads:");
+	for (size_t i = 0; i < NUM_WORKLOADS; i++)
+		printf(" %s", workloads[i].name);
+	printf("\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int opt;
+
+	bench.threads = 4;
+	bench.ops = 200000;
+	while ((opt = getopt(argc, argv, "a:t:n:")) != -1) {
+		switch (opt) {
+		case 'a':
+			only = optarg;
+			break;
+		case 't':
+			bench.threads = atoi(optarg);
+			break;
+		case 'n':
+			bench.ops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (bench.threads < 1 || bench.threads > MAX_THREADS || !bench.ops)
+		usage(argv[0]);
+
+	printf("%-9s %-6s %7s %12s %8s %8s %8s %9s %9s\n", "workload", "alloc", "threads",
+	       "ops/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "peak KiB");
+
+	for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+		int selected = optind == argc;
+
+		for (int j = optind; j < argc; j++)
+			if (!strcmp(argv[j], workloads[i].name))
+				selected = 1;
+		if (!selected)
+			continue;
+
+		for (size_t j = 0; j < sizeof(allocators) / sizeof(allocators[0]); j++) {
+			struct result result = { 0 };
+
+			if (only && strcmp(only, allocators[j].name))
+				continue;
+			if (run_child(&workloads[i], &allocators[j], &result)) {
+				printf("%-9s %-6s failed\n", workloads[i].name, allocators[j].name);
+				continue;
+			}
+			printf("%-9s %-6s %7d %12.0f %8u %8u %8u %9u %9ld\n", workloads[i].name,
+			       allocators[j].name,
+			       workloads[i].run == run_prodcons ? prodcons_threads(&bench) : bench.threads,
+			       result.ops / result.seconds, result.p50, result.p99, result.p999,
+			       result.max, result.hwm_kib);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * STL containers over the allocators of osmem.hpp against std::allocator
+ * (the malloc of glibc) and the std::pmr resources of libstdc++. Each
+ * workload builds its containers from scratch and drops them again, rounds
+ * times, as a service handling requests would; the arena resource is
+ * released after each round instead.
+ *
+ *	containers [-n elements] [-r rounds] [workload...]
+ *
+ * with the workloads vector, list, map and unordered_map, all of them by
+ * default, run with each allocator: std, osmem, pmr-newdel, pmr-heap,
+ * pmr-arena, pmr-pool and pmr-sync-pool.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "osmem.hpp"
+
+struct options {
+	std::size_t elements = 100000;
+	int rounds = 20;
+};
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long next_rand(unsigned long &x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+/*
+ * The workloads, over containers made by make(), which takes whatever an
+ * allocator needs. Each returns a checksum that keeps the work from being
+ * optimized away.
+ */
+template <class Vector>
+unsigned long vector_round(const options &opts, Vector &&vector)
+{
+	unsigned long sum = 0;
+
+	// many short vectors grown one element at a time, and one long one
+	for (std::size_t i = 0; i < opts.elements / 16; i++) {
+		auto small = vector();
+
+		for (int j = 0; j < 16; j++)
+			small.push_back(i + j);
+		sum += small.back();
+	}
+
+	auto large = vector();
+
+	for (std::size_t i = 0; i < opts.elements; i++)
+		large.push_back(i);
+	return sum + large.size();
+}
+
+template <class List>
+unsigned long list_round(const options &opts, List &&list)
+{
+	auto items = list();
+	unsigned long sum = 0;
+
+	// a queue that fills up and drains, nodes freed in the order they came
+	for (std::size_t i = 0; i < opts.elements; i++) {
+		items.push_back(i);
+		if (i % 4 == 3) {
+			sum += items.front();
+			items.pop_front();
+		}
+	}
+	return sum + items.size();
+}
+
+template <class Map>
+unsigned long map_round(const options &opts, Map &&map)
+{
+	auto items = map();
+	unsigned long x = 88172645463325252UL;
+
+	for (std::size_t i = 0; i < opts.elements; i++)
+		items[next_rand(x) % (opts.elements * 2)] = i;
+	// erase about half of them, at random
+	for (std::size_t i = 0; i < opts.elements; i++)
+		items.erase(next_rand(x) % (opts.elements * 2));
+	return items.size();
+}
+
+struct workload {
+	const char *name;
+	std::function<unsigned long(const options &, std::pmr::memory_resource *)> pmr;
+	std::function<unsigned long(const options &)> std_alloc;
+	std::function<unsigned long(const options &)> osmem_alloc;
+};
+
+template <class T>
+using osmem_vector = std::vector<T, osmem::allocator<T>>;
+template <class T>
+using osmem_list = std::list<T, osmem::allocator<T>>;
+template <class K, class V>
+using osmem_map = std::map<K, V, std::less<K>, osmem::allocator<std::pair<const K, V>>>;
+template <class K, class V>
+using osmem_unordered_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+					       osmem::allocator<std::pair<const K, V>>>;
+
+const workload workloads[] = {
+	{ "vector",
+	  [](const options &o, std::pmr::memory_resource *r) {
+		  return vector_round(o, [r] { return std::pmr::vector<unsigned long>(r); });
+	  },
+	  [](const options &o) { return vector_round(o, [] { return std::vector<unsigned long>(); }); },
+	  [](const options &o) { return vector_round(o, [] { return osmem_vector<unsigned long>(); }); } },
+	{ "list",
+	  [](const options &o, std::pmr::memory_resource *r) {
+		  return list_round(o, [r] { return std::pmr::list<unsigned long>(r); });
+	  },
+	  [](const options &o) { return list_round(o, [] { return std::list<unsigned long>(); }); },
+	  [](const options &o) { return list_round(o, [] { return osmem_list<unsigned long>(); }); } },
+	{ "map",
+	  [](const options &o, std::pmr::memory_resource *r) {
+		  return map_round(o, [r] { return std::pmr::map<unsigned long, unsigned long>(r); });
+	  },
+	  [](const options &o) { return map_round(o, [] { return std::map<unsigned long, unsigned long>(); }); },
+	  [](const options &o) { return map_round(o, [] { return osmem_map<unsigned long, unsigned long>(); }); } },
+	{ "unordered_map",
+	  [](const options &o, std::pmr::memory_resource *r) {
+		  return map_round(o, [r] { return std::pmr::unordered_map<unsigned long, unsigned long>(r); });
+	  },
+	  [](const options &o) {
+		  return map_round(o, [] { return std::unordered_map<unsigned long, unsigned long>(); });
+	  },
+	  [](const options &o) {
+		  return map_round(o, [] { return osmem_unordered_map<unsigned long, unsigned long>(); });
+	  } },
+};
+
+const char *const allocators[] = {
+	"std", "osmem", "pmr-newdel", "pmr-heap", "pmr-arena", "pmr-pool", "pmr-sync-pool",
+};
+
+// run the rounds of a workload with one allocator, returning the time they took
+double run(const workload &work, const char *alloc, const options &opts, unsigned long &sum)
+{
+	unsigned long start = now_ns();
+
+	if (!strcmp(alloc, "std")) {
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.std_alloc(opts);
+	} else if (!strcmp(alloc, "osmem")) {
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.osmem_alloc(opts);
+	} else if (!strcmp(alloc, "pmr-newdel")) {
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.pmr(opts, std::pmr::new_delete_resource());
+	} else if (!strcmp(alloc, "pmr-heap")) {
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.pmr(opts, osmem::get_heap_resource());
+	} else if (!strcmp(alloc, "pmr-arena")) {
+		osmem::arena_resource arena;
+
+		for (int i = 0; i < opts.rounds; i++) {
+			sum += work.pmr(opts, &arena);
+			arena.release();
+		}
+	} else if (!strcmp(alloc, "pmr-pool")) {
+		osmem::pool_resource pool;
+
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.pmr(opts, &pool);
+	} else {
+		std::pmr::synchronized_pool_resource pool;
+
+		for (int i = 0; i < opts.rounds; i++)
+			sum += work.pmr(opts, &pool);
+	}
+	return (now_ns() - start) / 1e9;
+}
+
+void usage(const char *name)
+{
+	printf("usage: %s [-n elements] [-r rounds] [workload...]\n", name);
+	printf("workloads:");
+	for (const auto &work : workloads)
+		printf(" %s", work.name);
+	printf("\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	options opts;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.elements = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.elements < 16 || opts.rounds < 1)
+		usage(argv[0]);
+
+	unsigned long sum = 0;
+
+	printf("%-14s %-14s %10s %10s\n", "workload", "alloc", "ms/round", "vs std");
+	for (const auto &work : workloads) {
+		bool wanted = optind == argc;
+
+		for (int i = optind; i < argc; i++)
+			wanted |= !strcmp(argv[i], work.name);
+		if (!wanted)
+			continue;
+
+		double base = 0;
+
+		for (const char *alloc : allocators) {
+			double seconds = run(work, alloc, opts, sum);
+
+			if (!base)
+				base = seconds;
+			printf("%-14s %-14s %10.2f %9.2fx\n", work.name, alloc, seconds * 1e3 / opts.rounds,
+			       base / seconds);
+		}
+	}
+	// the checksum is only there to be used
+	return sum == 42;
+}
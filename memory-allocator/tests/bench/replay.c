@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Replay a trace recorded with os_malloc_trace_start() or OSMEM_TRACE
+ * against libosmem and against the malloc of glibc (or whatever malloc is
+ * LD_PRELOADed), each in a child process of its own, and report the time
+ * and the peak RSS of each.
+ *
+ *	replay [-a osmem|glibc] [-t] trace
+ *
+ * Frees are replayed at the time they started and allocations at the time
+ * they returned, a realloc() taking its block at the one and moving it at
+ * the other, which keeps a block from being reused before it is released
+ * when the threads of the trace raced for it. With -t each thread
+ * of the trace gets a thread of its own, which keeps per-thread caches and
+ * arenas and cross-thread frees as they were, but the threads still take
+ * turns, one call at a time.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "osmem.h"
+
+#define MAX_THREADS 256
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*calloc)(size_t nmemb, size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+	void *(*memalign)(size_t align, size_t size);
+};
+
+struct allocator allocators[] = {
+	{ "osmem", os_malloc, os_free, os_calloc, os_realloc, os_memalign },
+	{ "glibc", malloc, free, calloc, realloc, aligned_alloc },
+};
+
+// what a child reports to the parent
+struct result {
+	unsigned long calls;
+	unsigned long unmatched;	/* frees and reallocs of blocks the trace never allocated */
+	double seconds;
+	long hwm_kib;
+};
+
+// the blocks of the trace still live, from the pointers in the trace to their replayed ones
+struct live_map {
+	uint64_t *keys;
+	void **values;
+	size_t mask;
+};
+
+// a point of the trace where a call is replayed, or a realloc() takes its block
+struct event {
+	uint64_t time;
+	const struct os_trace_record *record;
+	int release;
+};
+
+const struct allocator *alloc;
+const struct os_trace_record *records;
+struct event *order;
+size_t num_records, num_events;
+void **taken;			/* blocks of reallocs between their start and their end, by record */
+struct live_map live;
+unsigned long unmatched;
+size_t next_call;
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void *map_zeroed(size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// linear probing; a key of 0 is a free slot and freed keys are moved back over
+static inline size_t live_slot(uint64_t key)
+{
+	size_t slot = (key * 0x9e3779b97f4a7c15UL >> 20) & live.mask;
+
+	while (live.keys[slot] && live.keys[slot] != key)
+		slot = (slot + 1) & live.mask;
+	return slot;
+}
+
+void live_put(uint64_t key, void *value)
+{
+	size_t slot = live_slot(key);
+
+	live.keys[slot] = key;
+	live.values[slot] = value;
+}
+
+// take a block out of the map, NULL if it is not there
+void *live_take(uint64_t key)
+{
+	size_t slot = live_slot(key);
+	void *value = live.values[slot];
+
+	if (!live.keys[slot])
+		return NULL;
+
+	live.keys[slot] = 0;
+	// move the following keys of the cluster back where lookups will find them
+	for (size_t next = (slot + 1) & live.mask; live.keys[next]; next = (next + 1) & live.mask) {
+		uint64_t key = live.keys[next];
+		size_t home = (key * 0x9e3779b97f4a7c15UL >> 20) & live.mask;
+
+		if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+			live.keys[slot] = key;
+			live.values[slot] = live.values[next];
+			live.keys[next] = 0;
+			slot = next;
+		}
+	}
+	return value;
+}
+
+// touch an allocation, as a program would
+static inline void touch(void *ptr, size_t size)
+{
+	if (ptr && size) {
+		((char *)ptr)[0] = 1;
+		((char *)ptr)[size - 1] = 1;
+	}
+}
+
+void replay_event(const struct event *event)
+{
+	const struct os_trace_record *record = event->record;
+	void *ptr = NULL;
+
+	// a realloc() takes its block out of the live ones when it starts
+	if (event->release) {
+		taken[record - records] = live_take(record->ptr);
+		if (!taken[record - records])
+			unmatched++;
+		return;
+	}
+
+	switch (record->op) {
+	case OS_TRACE_MALLOC:
+		ptr = alloc->malloc(record->size);
+		touch(ptr, record->size);
+		break;
+	case OS_TRACE_CALLOC:
+		ptr = alloc->calloc(record->ptr, record->size);
+		touch(ptr, record->ptr * record->size);
+		break;
+	case OS_TRACE_MEMALIGN:
+		ptr = alloc->memalign(record->ptr, record->size);
+		touch(ptr, record->size);
+		break;
+	case OS_TRACE_FREE:
+		if (!record->ptr)
+			return;
+		ptr = live_take(record->ptr);
+		if (ptr)
+			alloc->free(ptr);
+		else
+			unmatched++;
+		return;
+	case OS_TRACE_REALLOC:
+		if (record->ptr) {
+			ptr = taken[record - records];
+			if (!ptr)
+				return;
+		}
+		ptr = alloc->realloc(ptr, record->size);
+		touch(ptr, record->size);
+		break;
+	default:
+		return;
+	}
+
+	if (ptr && record->result)
+		live_put(record->result, ptr);
+}
+
+// replay the calls of one thread of the trace, waiting for its turn before each
+void *replay_thread(void *arg)
+{
+	uint32_t thread = (uintptr_t)arg;
+
+	for (;;) {
+		size_t call = __atomic_load_n(&next_call, __ATOMIC_ACQUIRE);
+
+		if (call == num_events)
+			break;
+		if (order[call].record->thread != thread) {
+			sched_yield();
+			continue;
+		}
+		replay_event(&order[call]);
+		__atomic_store_n(&next_call, call + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int compare_events(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	// at one time blocks are released first, then events stay in the order of the file
+	if (x->release != y->release)
+		return y->release - x->release;
+	return x->record < y->record ? -1 : x->record > y->record;
+}
+
+// obtain the peak RSS of the process, in KiB
+long peak_rss(void)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	char *line = strstr(buf, "VmHWM:");
+
+	return line ? atol(line + 6) : 0;
+}
+
+void replay(int threaded, uint32_t threads, struct result *result)
+{
+	size_t slots = 1024;
+
+	while (slots < num_events * 2)
+		slots *= 2;
+	live.keys = map_zeroed(slots * sizeof(uint64_t));
+	live.values = map_zeroed(slots * sizeof(void *));
+	live.mask = slots - 1;
+
+	unsigned long start = now_ns();
+
+	if (threaded) {
+		pthread_t ids[MAX_THREADS];
+
+		for (uint32_t i = 0; i < threads; i++)
+			pthread_create(&ids[i], NULL, replay_thread, (void *)(uintptr_t)i);
+		for (uint32_t i = 0; i < threads; i++)
+			pthread_join(ids[i], NULL);
+	} else {
+		for (size_t i = 0; i < num_events; i++)
+			replay_event(&order[i]);
+	}
+
+	result->seconds = (now_ns() - start) / 1e9;
+	result->calls = num_records;
+	result->unmatched = unmatched;
+	result->hwm_kib = peak_rss();
+}
+
+int run_child(const struct allocator *with, int threaded, uint32_t threads, struct result *result)
+{
+	int fds[2];
+
+	if (pipe(fds))
+		return -1;
+
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		close(fds[0]);
+		alloc = with;
+		replay(threaded, threads, result);
+		if (write(fds[1], result, sizeof(*result)) != sizeof(*result))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	ssize_t len = read(fds[0], result, sizeof(*result));
+	int status;
+
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return len == sizeof(*result) && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+void usage(const char *name)
+{
+	printf("usage: %s [-a osmem|glibc] [-t] trace\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int threaded = 0, opt;
+
+	while ((opt = getopt(argc, argv, "a:t")) != -1) {
+		switch (opt) {
+		case 'a':
+			only = optarg;
+			break;
+		case 't':
+			threaded = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(struct os_trace_header)) {
+		printf("%s: cannot read the trace\n", argv[optind]);
+		return 1;
+	}
+
+	const struct os_trace_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (header == MAP_FAILED || memcmp(header->magic, OS_TRACE_MAGIC, sizeof(header->magic)) ||
+	    header->version != OS_TRACE_VERSION || header->record_size != sizeof(struct os_trace_record)) {
+		printf("%s: not a trace of this version\n", argv[optind]);
+		return 1;
+	}
+
+	uint32_t threads = 0;
+
+	records = (const void *)(header + 1);
+	num_records = (st.st_size - sizeof(*header)) / sizeof(struct os_trace_record);
+	order = map_zeroed((2 * num_records + 1) * sizeof(*order));
+	taken = map_zeroed((num_records + 1) * sizeof(*taken));
+	for (size_t i = 0; i < num_records; i++) {
+		const struct os_trace_record *record = &records[i];
+
+		// frees happen when they start, allocations when they return
+		order[num_events++] = (struct event){ record->op == OS_TRACE_FREE ? record->start : record->end,
+						      record, 0 };
+		if (record->op == OS_TRACE_REALLOC && record->ptr)
+			order[num_events++] = (struct event){ record->start, record, 1 };
+		if (record->thread >= threads)
+			threads = record->thread + 1;
+	}
+	qsort(order, num_events, sizeof(*order), compare_events);
+	if (threaded && threads > MAX_THREADS) {
+		printf("%s: %u threads, more than %d\n", argv[optind], threads, MAX_THREADS);
+		return 1;
+	}
+
+	printf("%lu calls from %u threads, replayed %s\n", (unsigned long)num_records, threads,
+	       threaded ? "on as many threads" : "on one thread");
+	printf("%-6s %12s %10s %9s %9s\n", "alloc", "calls/s", "ns/call", "peak KiB", "unmatched");
+
+	for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		struct result result = { 0 };
+
+		if (only && strcmp(only, allocators[i].name))
+			continue;
+		if (run_child(&allocators[i], threaded, threads, &result)) {
+			printf("%-6s failed\n", allocators[i].name);
+			continue;
+		}
+		printf("%-6s %12.0f %10.1f %9ld %9lu\n", allocators[i].name, result.calls / result.seconds,
+		       result.seconds * 1e9 / (result.calls ? result.calls : 1), result.hwm_kib, result.unmatched);
+	}
+	return 0;
+}
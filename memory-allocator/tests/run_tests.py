@@ -50,6 +50,34 @@ TESTS = {
     "test-all": 5,
 }
 
+# Tests of the rest of the API: they check their results themselves and
+# print them, and run without ltrace, in the environment given, for no points;
+# LD_PRELOAD names a library of SRC_PATH
+API_TESTS = {
+    "test-api-memalign": {},
+    "test-api-sized": {},
+    "test-api-batch": {},
+    "test-api-stats": {},
+    "test-api-prof": {},
+    "test-api-preload": {"LD_PRELOAD": "libosmem_preload.so"},
+    "test-api-trace": {},
+    "test-api-region": {},
+    "test-api-pool": {},
+    "test-api-dynamic": {},
+    "test-api-threads": {},
+    "test-api-arenas": {"OSMEM_ARENAS": "4"},
+    "test-api-slab": {"OSMEM_SLAB": "1"},
+    "test-api-pagemap": {"OSMEM_ARENAS": "2"},
+    "test-api-largecache": {"OSMEM_LARGE_CACHE": "4194304", "OSMEM_LARGE_DECAY": "200"},
+    "test-api-mremap": {"OSMEM_MREMAP": "1"},
+    "test-api-trim": {"OSMEM_TRIM_THRESHOLD": "65536"},
+    "test-api-purge": {"OSMEM_PURGE_INTERVAL": "20", "OSMEM_DIRTY_DECAY": "100", "OSMEM_MUZZY_DECAY": "200",
+                       "OSMEM_LARGE_CACHE": "4194304"},
+    "test-api-calloc": {},
+    "test-api-remote": {"OSMEM_REMOTE_FREE": "1", "OSMEM_ARENAS": "2", "OSMEM_TCACHE": "0"},
+    "test-api-cxx": {"OSMEM_SLAB": "1"},
+}
+
 
 class UnfinishedCall(Exception):
     def __init__(self, *args: object) -> None:
@@ -307,6 +335,8 @@ class Test:
 
         self.env = os.environ.copy()
         self.env["LD_LIBRARY_PATH"] = os.environ.get("SRC_PATH", Test.SRC_PATH)
+        self.pass_msg = f" passed ...   {self.points}"
+        self.fail_msg = " failed ...   0"
 
         print(self.name.ljust(33) + 24 * ".", end="")
 
@@ -344,8 +374,6 @@ class Test:
             memcheck = True
 
         debug_msg = " debug"
-        pass_msg = f" passed ...   {self.points}"
-        fail_msg = " failed ...   0"
 
         diff_err = ""
         memcheck_err = ""
@@ -363,7 +391,7 @@ class Test:
             return 0
 
         result = not diff_err and not memcheck_err
-        print(pass_msg if result else fail_msg)
+        print(self.pass_msg if result else self.fail_msg)
 
         if diff_err:
             if len(diff_err) > 20:
@@ -428,6 +456,41 @@ class Test:
         return diffs
 
 
+class ApiTest(Test):
+    def __init__(self, name, env) -> None:
+        super().__init__(name, 0)
+        self.pass_msg = " passed"
+        self.fail_msg = " failed"
+
+        for var, value in env.items():
+            if var == "LD_PRELOAD":
+                value = os.path.join(self.env["LD_LIBRARY_PATH"], value)
+            self.env[var] = value
+
+    def run(self):
+        if not os.path.isfile(self.test_file.executable):
+            print(f"Failed to open {self.test_file.executable}", file=sys.stderr)
+            sys.exit(-1)
+
+        with Popen(
+            [self.test_file.executable],
+            stdout=PIPE,
+            stderr=PIPE,
+            env=self.env,
+        ) as proc:
+            stdout, stderr = proc.communicate()
+            self.program_output = stdout.decode("ascii")
+            self.output = (
+                self.program_output
+                + "".join(
+                    line + "\n"
+                    for line in stderr.decode("ascii").splitlines()
+                    if line.startswith("(")
+                )
+                + f"+++ exited (status {proc.returncode}) +++\n"
+            )
+
+
 def parse_args():
     parser = argparse.ArgumentParser()
     parser.add_argument(
@@ -462,7 +525,11 @@ def main():
     test_name, verbose, diff, memcheck = parse_args()
 
     if test_name:
-        test = Test(test_name, 1)
+        name = os.path.basename(test_name)
+        if name in API_TESTS:
+            test = ApiTest(name, API_TESTS[name])
+        else:
+            test = Test(test_name, 1)
         test.run()
         test.grade(verbose, diff, memcheck)
         return
@@ -473,7 +540,16 @@ def main():
         if test.grade(verbose, diff, memcheck):
             total += score
 
-    print("\nTotal:" + " " * 59 + f" {total}/100")
+    print("\nTotal:" + " " * 59 + f" {total}/100\n")
+
+    passed = 0
+    for test_name, env in API_TESTS.items():
+        test = ApiTest(test_name, env)
+        test.run()
+        if test.grade(verbose, diff, memcheck):
+            passed += 1
+
+    print("\nAPI tests:" + " " * 55 + f" {passed}/{len(API_TESTS)}")
 
 
 if __name__ == "__main__":
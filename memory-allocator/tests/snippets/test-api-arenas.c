@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+
+#define ARENAS 4	/* OSMEM_ARENAS the test runs with */
+#define THREADS 8
+#define BLOCKS 100
+#define SEGMENT (1024 * MULT_KB)
+
+pthread_barrier_t allocated, checked;
+
+// fill the heap of its arena, and ask for a block no segment holds
+void *worker(void *arg)
+{
+	void *ptrs[BLOCKS];
+	void *large;
+
+	(void)arg;
+	for (int i = 0; i < BLOCKS; i++) {
+		ptrs[i] = os_malloc_checked(1000);
+		memset(ptrs[i], i, 1000);
+	}
+	large = os_malloc_checked(2 * SEGMENT);
+	memset(large, 0xff, 2 * SEGMENT);
+
+	pthread_barrier_wait(&allocated);
+	pthread_barrier_wait(&checked);
+
+	for (int i = 0; i < BLOCKS; i++) {
+		for (int j = 0; j < 1000; j++)
+			FAIL(((unsigned char *)ptrs[i])[j] != (unsigned char)i, "DBG: arena blocks overlap");
+		os_free(ptrs[i]);
+	}
+	os_free(large);
+	return NULL;
+}
+
+int main(void)
+{
+	struct os_arena_stats arenas[ARENAS + 1];
+	struct os_malloc_stats stats;
+	pthread_t threads[THREADS];
+	int used;
+
+	/* Blocks of 2 MiB are heap blocks, where a heap can hold them */
+	os_mallopt(OS_M_MMAP_THRESHOLD, 4 * SEGMENT);
+	os_free(os_malloc_checked(100));
+
+	used = os_malloc_arena_stats(arenas, ARENAS + 1);
+	printf("one thread: %d arena\n", used);
+
+	pthread_barrier_init(&allocated, NULL, THREADS + 1);
+	pthread_barrier_init(&checked, NULL, THREADS + 1);
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_create(&threads[i], NULL, worker, NULL), "pthread_create");
+	pthread_barrier_wait(&allocated);
+
+	/* The threads are spread evenly over OSMEM_ARENAS arenas */
+	used = os_malloc_arena_stats(arenas, ARENAS + 1);
+	printf("%d threads: %d arenas\n", THREADS, used);
+	for (int i = 0; i < used; i++) {
+		FAIL(!arenas[i].lock_acquisitions, "DBG: arena never locked");
+		printf("arena %d: %d threads, %s\n", i, arenas[i].threads,
+		       arenas[i].segments ? "segments" : "no segments");
+	}
+
+	// only the sbrk heap grows past a segment, the others map such blocks
+	os_malloc_stats(&stats);
+	printf("blocks larger than a segment mmap'd: %zu\n", stats.mapped_blocks);
+	FAIL(stats.segment_size < (size_t)(used - 1) * SEGMENT, "DBG: segment_size misses the segments");
+
+	pthread_barrier_wait(&checked);
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_join(threads[i], NULL), "pthread_join");
+
+	os_malloc_stats(&stats);
+	printf("after the threads: %zu blocks mmap'd\n", stats.mapped_blocks);
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define BATCH 500
+
+size_t sizes[] = {16, 100, 2000, 200 * MULT_KB};
+
+// check that the blocks of a batch are usable and do not overlap
+void check_batch(void **ptrs, size_t count, size_t size)
+{
+	for (size_t i = 0; i < count; i++) {
+		FAIL(!ptrs[i], "DBG: os_malloc_batch returned a NULL block");
+		FAIL(os_malloc_usable_size(ptrs[i]) < size, "DBG: os_malloc_batch returned a short block");
+		memset(ptrs[i], (int)i, size);
+	}
+	for (size_t i = 0; i < count; i++)
+		for (size_t j = 0; j < size; j++)
+			FAIL(((unsigned char *)ptrs[i])[j] != (unsigned char)i, "DBG: os_malloc_batch blocks overlap");
+}
+
+int main(void)
+{
+	static void *ptrs[BATCH];
+	size_t done;
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t count = sizes[i] < MMAP_THRESHOLD ? BATCH : 8;
+
+		done = os_malloc_batch(sizes[i], count, ptrs);
+		printf("os_malloc_batch(%zu, %zu) = %zu\n", sizes[i], count, done);
+		check_batch(ptrs, done, sizes[i]);
+
+		// single frees and batch frees mix
+		os_free(ptrs[0]);
+		ptrs[0] = NULL;
+		os_free_batch(ptrs, done);
+	}
+
+	/* Blocks of os_malloc() go back through a batch too */
+	for (unsigned int i = 0; i < 100; i++)
+		ptrs[i] = os_malloc_checked(inc_sz_sm[i % NUM_SZ_SM]);
+	os_free_batch(ptrs, 100);
+	printf("os_free_batch: freed os_malloc blocks\n");
+
+	/* Nothing to allocate, or too much */
+	done = os_malloc_batch(0, 10, ptrs);
+	printf("os_malloc_batch(0, 10) = %zu\n", done);
+
+	done = os_malloc_batch(100, 0, ptrs);
+	printf("os_malloc_batch(100, 0) = %zu\n", done);
+
+	errno = 0;
+	done = os_malloc_batch(SIZE_MAX - 100, 10, ptrs);
+	printf("os_malloc_batch(SIZE_MAX - 100, 10) = %zu, errno %s\n", done, err_name(errno));
+
+	os_free_batch(ptrs, 0);
+	printf("os_free_batch(0): ignored\n");
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define SMALL 3000
+#define BLOCKS 30
+#define LARGE (100 * MULT_KB)
+
+// check that size bytes at ptr are all zero
+int zeroed(void *ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		if (((unsigned char *)ptr)[i])
+			return 0;
+	return 1;
+}
+
+int main(void)
+{
+	void *ptrs[BLOCKS];
+	void *ptr, *again, *guard;
+
+	/* Fresh memory, from the heap or mmap'd */
+	ptr = os_calloc_checked(1, SMALL);
+	FAIL(!zeroed(ptr, SMALL), "DBG: os_calloc returned fresh heap memory not zeroed");
+	os_free(ptr);
+	ptr = os_calloc_checked(1, 4 * LARGE);
+	FAIL(!zeroed(ptr, 4 * LARGE), "DBG: os_calloc returned an mmap'd block not zeroed");
+	os_free(ptr);
+	printf("os_calloc: fresh memory zeroed\n");
+
+	/* A block dirtied and freed comes back cleared */
+	ptr = os_malloc_checked(SMALL);
+	memset(ptr, 0xff, SMALL);
+	os_free(ptr);
+	again = os_calloc_checked(1, SMALL);
+	FAIL(again != ptr, "DBG: os_calloc did not reuse the freed block");
+	FAIL(!zeroed(again, SMALL), "DBG: os_calloc returned a dirty block");
+	os_free(again);
+	printf("os_calloc: dirty block cleared\n");
+
+	/*
+	 * Pages given back are known to be zero, but not the headers written
+	 * into them since: blocks carved one after the other out of them are
+	 * zero all the same
+	 */
+	ptr = os_malloc_checked(LARGE);
+	guard = os_malloc_checked(MULT_KB);
+	memset(ptr, 0xff, LARGE);
+	os_free(ptr);
+	FAIL(!os_malloc_purge(), "DBG: os_malloc_purge gave no pages back");
+	for (int i = 0; i < BLOCKS; i++) {
+		ptrs[i] = os_calloc_checked(1, SMALL);
+		FAIL(ptrs[i] < ptr || ptrs[i] >= guard, "DBG: os_calloc did not reuse the purged block");
+		FAIL(!zeroed(ptrs[i], SMALL), "DBG: os_calloc returned a dirty block out of purged pages");
+		memset(ptrs[i], 0xff, SMALL);
+	}
+	printf("os_calloc: purged pages and their headers zeroed\n");
+
+	/* Once dirtied again, they are cleared again */
+	for (int i = 0; i < BLOCKS; i++)
+		os_free(ptrs[i]);
+	for (int i = 0; i < BLOCKS; i++) {
+		ptrs[i] = os_calloc_checked(1, SMALL);
+		FAIL(!zeroed(ptrs[i], SMALL), "DBG: os_calloc returned a dirty block");
+	}
+	for (int i = 0; i < BLOCKS; i++)
+		os_free(ptrs[i]);
+	os_free(guard);
+	printf("os_calloc: dirtied pages cleared\n");
+
+	return 0;
+}
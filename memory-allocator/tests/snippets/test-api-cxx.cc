@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <list>
+#include <thread>
+#include <vector>
+#include "osmem.hpp"
+
+/* Run with OSMEM_SLAB=1, as run_tests.py does, so sized frees of small blocks go to the slabs */
+#define FAIL(assertion, feedback)										\
+	do {													\
+		if (assertion) {										\
+			fprintf(stderr, "(%s, %d): %s", __FILE__, __LINE__, feedback);				\
+			exit(SIGABRT);										\
+		}												\
+	} while (0)
+
+#define THREADS 8
+#define ROUNDS 5
+#define BLOCKS 200
+
+struct alignas(64) wide {
+	char bytes[100];
+};
+
+static bool is_aligned(const void *ptr, std::size_t align)
+{
+	return !(reinterpret_cast<std::uintptr_t>(ptr) & (align - 1));
+}
+
+// obtain the payload bytes in use
+static std::size_t in_use()
+{
+	struct os_malloc_stats stats;
+
+	os_malloc_stats(&stats);
+	return stats.in_use;
+}
+
+// allocate blocks of every pool class from a resource, all threads at once
+static void pool_worker(std::pmr::memory_resource *resource, std::atomic<int> *ready, int id)
+{
+	void *blocks[osmem::pool_resource::classes][BLOCKS];
+
+	ready->fetch_add(1);
+	while (ready->load() < THREADS)
+		;
+
+	for (int c = 0; c < osmem::pool_resource::classes; c++) {
+		std::size_t size = osmem::pool_resource::min_pooled << c;
+
+		for (int i = 0; i < BLOCKS; i++) {
+			blocks[c][i] = resource->allocate(size, 8);
+			memset(blocks[c][i], id, size);
+		}
+	}
+	for (int c = 0; c < osmem::pool_resource::classes; c++) {
+		std::size_t size = osmem::pool_resource::min_pooled << c;
+
+		for (int i = 0; i < BLOCKS; i++) {
+			for (std::size_t j = 0; j < size; j++)
+				FAIL(static_cast<unsigned char *>(blocks[c][i])[j] != id, "DBG: pool blocks overlap");
+			// half go back one by one, the others with release()
+			if (i % 2)
+				resource->deallocate(blocks[c][i], size, 8);
+		}
+	}
+}
+
+int main()
+{
+	std::size_t before;
+
+	/* Over-aligned elements come from os_aligned_alloc(), the others from os_malloc() */
+	before = in_use();
+	{
+		std::vector<wide, osmem::allocator<wide>> wides;
+		std::list<int, osmem::allocator<int>> ints;
+
+		for (int i = 0; i < 1000; i++) {
+			wides.push_back(wide());
+			FAIL(!is_aligned(wides.data(), alignof(wide)), "DBG: allocator<T> misaligned an over-aligned T");
+			ints.push_back(i);
+		}
+		int i = 0;
+
+		for (int value : ints)
+			FAIL(value != i++, "DBG: allocator<T> lost list nodes");
+	}
+	FAIL(in_use() != before, "DBG: allocator<T> leaked blocks");
+	printf("allocator<T>: aligned to %zu, all freed\n", alignof(wide));
+
+	/* Sized frees of the heap resource match the blocks allocated, slots included */
+	std::size_t sizes[] = { 0, 1, 20, 100, 128, 129, 1000, 5000, 200 * 1024 };
+	std::size_t aligns[] = { 1, 8, 32, 4096 };
+	std::pmr::memory_resource *heap = osmem::get_heap_resource();
+
+	before = in_use();
+	for (std::size_t align : aligns) {
+		void *blocks[sizeof(sizes) / sizeof(sizes[0])];
+
+		for (std::size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			blocks[i] = heap->allocate(sizes[i], align);
+			FAIL(!is_aligned(blocks[i], align), "DBG: heap_resource misaligned a block");
+			FAIL(os_malloc_usable_size(blocks[i]) < sizes[i], "DBG: heap_resource returned a short block");
+			memset(blocks[i], 1, sizes[i]);
+		}
+		for (std::size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			heap->deallocate(blocks[i], sizes[i], align);
+	}
+	FAIL(in_use() != before, "DBG: heap_resource did not free what it allocated");
+	FAIL(!heap->is_equal(osmem::heap_resource()), "DBG: heap_resources differ");
+	printf("heap_resource: sized frees matched\n");
+
+	/* Threads racing to create the pools of a resource, which release() then frees */
+	osmem::pool_resource pools;
+
+	for (int round = 0; round < ROUNDS; round++) {
+		std::vector<std::thread> threads;
+		std::atomic<int> ready(0);
+
+		for (int id = 0; id < THREADS; id++)
+			threads.emplace_back(pool_worker, &pools, &ready, id + 1);
+		for (auto &thread : threads)
+			thread.join();
+		pools.release();
+	}
+	printf("pool_resource: %d rounds of %d threads, released\n", ROUNDS, THREADS);
+
+	/* Blocks past the pools come from upstream */
+	before = in_use();
+	void *large = pools.allocate(8192, 8);
+	void *aligned = pools.allocate(64, 128);
+
+	FAIL(in_use() < before + 8192 + 64, "DBG: pool_resource pooled blocks it cannot");
+	FAIL(!is_aligned(aligned, 128), "DBG: pool_resource misaligned a block");
+	pools.deallocate(large, 8192, 8);
+	pools.deallocate(aligned, 64, 128);
+	FAIL(in_use() != before, "DBG: pool_resource did not free upstream blocks");
+	printf("pool_resource: larger blocks from upstream\n");
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/wait.h>
+#include "test-utils.h"
+
+#define ENV_VARS 3
+#define MALLOPTS 2
+
+/* Settings a child starts from, before its first call into the allocator */
+struct dynamic_case {
+	const char *name;
+	const char *env[ENV_VARS];	/* NAME=value, applied first */
+	int mallopt[MALLOPTS][2];	/* param, value, then applied in order */
+};
+
+struct dynamic_case cases[] = {
+	{ "default", { NULL }, { { -1 } } },
+	{ "env dynamic", { "OSMEM_MMAP_DYNAMIC=1" }, { { -1 } } },
+	{ "env dynamic, heap growth", { "OSMEM_MMAP_DYNAMIC=1", "OSMEM_HEAP_GROWTH=1048576" }, { { -1 } } },
+	{ "env dynamic, threshold", { "OSMEM_MMAP_DYNAMIC=1", "OSMEM_MMAP_THRESHOLD=131072" }, { { -1 } } },
+	{ "env dynamic, trim", { "OSMEM_MMAP_DYNAMIC=1", "OSMEM_TRIM_THRESHOLD=262144" }, { { -1 } } },
+	{ "env threshold", { "OSMEM_MMAP_THRESHOLD=200000" }, { { -1 } } },
+	{ "env dynamic, mallopt threshold", { "OSMEM_MMAP_DYNAMIC=1" },
+	  { { OS_M_MMAP_THRESHOLD, 200000 }, { -1 } } },
+	{ "env dynamic, mallopt trim", { "OSMEM_MMAP_DYNAMIC=1" },
+	  { { OS_M_TRIM_THRESHOLD, 262144 }, { -1 } } },
+	{ "mallopt dynamic, heap growth", { NULL },
+	  { { OS_M_MMAP_DYNAMIC, 1 }, { OS_M_HEAP_GROWTH, 1048576 } } },
+	{ "mallopt threshold, dynamic", { NULL },
+	  { { OS_M_MMAP_THRESHOLD, 200000 }, { OS_M_MMAP_DYNAMIC, 1 } } },
+	{ "mallopt dynamic, threshold", { NULL },
+	  { { OS_M_MMAP_DYNAMIC, 1 }, { OS_M_MMAP_THRESHOLD, 200000 } } },
+};
+
+// free an mmap'd block and report the threshold it leaves behind
+void run_case(struct dynamic_case *test)
+{
+	struct os_malloc_stats stats;
+	void *ptr;
+
+	for (int i = 0; i < ENV_VARS && test->env[i]; i++)
+		DIE(putenv((char *)test->env[i]), "putenv");
+	for (int i = 0; i < MALLOPTS && test->mallopt[i][0] >= 0; i++)
+		FAIL(!os_mallopt(test->mallopt[i][0], test->mallopt[i][1]), "DBG: os_mallopt rejected a valid value");
+
+	ptr = os_malloc_checked(300 * MULT_KB);
+	os_free(ptr);
+
+	os_malloc_stats(&stats);
+	printf("%s: mmap_threshold = %zu\n", test->name, stats.mmap_threshold);
+}
+
+int main(void)
+{
+	/* Each case in a child, which reads the environment on its first call */
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		int status;
+		pid_t pid = fork();
+
+		DIE(pid < 0, "fork");
+		if (!pid) {
+			run_case(&cases[i]);
+			exit(0);
+		}
+		DIE(waitpid(pid, &status, 0) < 0, "waitpid");
+		FAIL(!WIFEXITED(status) || WEXITSTATUS(status), "DBG: case failed");
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+#include "test-utils.h"
+
+/* OSMEM_LARGE_CACHE and OSMEM_LARGE_DECAY, as run_tests.py sets them */
+#define CACHE_SIZE (4 * 1024 * MULT_KB)
+#define DECAY_MS 200
+#define BLOCK (1024 * MULT_KB)
+#define BLOCKS 4
+
+struct os_malloc_stats stats;
+
+// obtain the length of the mapping of a block of size bytes
+size_t mapping(size_t size)
+{
+	return (size + METADATA_SIZE + 4095) & ~(size_t)4095;
+}
+
+// obtain the bytes of freed mmap'd blocks in the cache
+size_t cached(void)
+{
+	os_malloc_stats(&stats);
+	return stats.large_cached;
+}
+
+int main(void)
+{
+	void *ptrs[BLOCKS], *reused[BLOCKS];
+	void *ptr, *again;
+	unsigned long mmaps, munmaps;
+
+	/* Freed blocks keep the threshold where it is, below them */
+	os_mallopt(OS_M_MMAP_THRESHOLD, MMAP_THRESHOLD);
+
+	/* A freed block is reused for a request that wastes up to a quarter of it */
+	ptr = os_malloc_checked(BLOCK);
+	os_free(ptr);
+	FAIL(cached() != mapping(BLOCK), "DBG: os_free did not cache the block");
+	mmaps = stats.mmap_calls;
+	again = os_malloc_checked(BLOCK - 100 * MULT_KB);
+	FAIL(again != ptr, "DBG: os_malloc did not reuse the cached block");
+	FAIL(cached() || stats.mmap_calls != mmaps, "DBG: os_malloc mapped a block it had cached");
+	FAIL(os_malloc_usable_size(again) < BLOCK, "DBG: os_malloc lost the end of the cached block");
+	memset(again, 1, BLOCK);
+	printf("os_malloc(%d KiB): reused the cached %d KiB block\n", (BLOCK - 100 * MULT_KB) / MULT_KB, BLOCK / MULT_KB);
+
+	/* One that wastes more maps a block of its own */
+	os_free(again);
+	mmaps = stats.mmap_calls;
+	again = os_malloc_checked(BLOCK / 2);
+	FAIL(cached() != mapping(BLOCK) || stats.mmap_calls != mmaps + 1, "DBG: os_malloc wasted the cached block");
+	os_free(again);
+	printf("os_malloc(%d KiB): mapped, the cached block is too large\n", BLOCK / 2 / MULT_KB);
+
+	/* The blocks cached first are unmapped to stay under the cap */
+	os_malloc_purge();
+	FAIL(cached(), "DBG: os_malloc_purge kept cached blocks");
+	for (int i = 0; i < BLOCKS; i++)
+		ptrs[i] = os_malloc_checked(BLOCK);
+	os_malloc_stats(&stats);
+	munmaps = stats.munmap_calls;
+	for (int i = 0; i < BLOCKS; i++)
+		os_free(ptrs[i]);
+	FAIL(cached() > CACHE_SIZE, "DBG: os_free cached more than OSMEM_LARGE_CACHE");
+	FAIL(stats.munmap_calls != munmaps + 1, "DBG: os_free did not evict one block");
+	printf("%d blocks of %d KiB freed: %zu cached\n", BLOCKS, BLOCK / MULT_KB, cached() / mapping(BLOCK));
+
+	mmaps = stats.mmap_calls;
+	for (int i = 1; i < BLOCKS; i++) {
+		reused[i] = os_malloc_checked(BLOCK);
+		FAIL(reused[i] != ptrs[1] && reused[i] != ptrs[2] && reused[i] != ptrs[3], "DBG: os_free evicted a newer block");
+	}
+	FAIL(cached() || stats.mmap_calls != mmaps, "DBG: os_malloc did not reuse the newer blocks");
+	for (int i = 1; i < BLOCKS; i++)
+		os_free(reused[i]);
+	printf("os_free: evicted the least recently cached block\n");
+
+	/* Blocks larger than the cap are unmapped at once */
+	munmaps = stats.munmap_calls;
+	ptr = os_malloc_checked(2 * CACHE_SIZE);
+	os_free(ptr);
+	FAIL(cached() != 3 * mapping(BLOCK) || stats.munmap_calls != munmaps + 1, "DBG: os_free cached a block over the cap");
+	printf("os_malloc(%d KiB): unmapped on os_free\n", 2 * CACHE_SIZE / MULT_KB);
+
+	/* Blocks cached for longer than the decay are unmapped on the next os_free */
+	nanosleep(&(struct timespec){ .tv_nsec = 2 * DECAY_MS * 1000000L }, NULL);
+	ptr = os_malloc_checked(2 * BLOCK);
+	munmaps = stats.munmap_calls;
+	os_free(ptr);
+	FAIL(cached() != mapping(2 * BLOCK), "DBG: os_free kept the blocks past OSMEM_LARGE_DECAY");
+	FAIL(stats.munmap_calls != munmaps + 3, "DBG: os_free did not unmap the decayed blocks");
+	printf("os_free after %d ms: unmapped the decayed blocks\n", 2 * DECAY_MS);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+size_t aligns[] = {8, 16, 64, 4096, 2 * 1024 * 1024};
+size_t sizes[] = {1, 100, 5000, 300 * MULT_KB};
+
+int main(void)
+{
+	void *heap_ptrs[64], *fillers[64];
+	void *ptr;
+	int ret;
+
+	/* Alignments from the heap and from mmap'd blocks */
+	for (unsigned int i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+		for (unsigned int j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			ptr = os_memalign(aligns[i], sizes[j]);
+			FAIL(!ptr, "DBG: os_memalign returned NULL on valid size");
+			FAIL(!is_aligned(ptr, aligns[i]), "DBG: os_memalign returned a misaligned block");
+			FAIL(os_malloc_usable_size(ptr) < sizes[j], "DBG: os_memalign returned a short block");
+			memset(ptr, 0xab, sizes[j]);
+
+			ptr = os_realloc(ptr, sizes[j] * 2);
+			FAIL(!ptr || ((unsigned char *)ptr)[sizes[j] - 1] != 0xab, "DBG: os_realloc lost aligned data");
+			os_free(ptr);
+		}
+		printf("os_memalign(%zu): aligned\n", aligns[i]);
+	}
+
+	/* Heap blocks, aligned by luck or not, keep no more than their size */
+	for (int i = 0; i < 64; i++) {
+		/* shift the heap top so some blocks come back aligned already */
+		fillers[i] = os_malloc_checked(8 * (i + 1));
+		heap_ptrs[i] = os_memalign(64, 100);
+		FAIL(!heap_ptrs[i] || !is_aligned(heap_ptrs[i], 64), "DBG: os_memalign returned a misaligned block");
+		FAIL(os_malloc_usable_size(heap_ptrs[i]) > 104 + METADATA_SIZE, "DBG: os_memalign kept the slack");
+	}
+	for (int i = 0; i < 64; i++) {
+		os_free(heap_ptrs[i]);
+		os_free(fillers[i]);
+	}
+	printf("os_memalign(64, 100): slack given back\n");
+
+	ptr = os_aligned_alloc(256, 1000);
+	FAIL(!ptr || !is_aligned(ptr, 256), "DBG: os_aligned_alloc returned a misaligned block");
+	os_free(ptr);
+	printf("os_aligned_alloc(256): aligned\n");
+
+	/* Alignments that are not powers of two, or too large to be met */
+	errno = 0;
+	ptr = os_memalign(48, 100);
+	printf("os_memalign(48, 100) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	errno = 0;
+	ptr = os_memalign(4096, SIZE_MAX - 100);
+	printf("os_memalign(4096, SIZE_MAX - 100) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	errno = 0;
+	ptr = os_memalign((size_t)1 << 62, (size_t)1 << 62);
+	printf("os_memalign(1 << 62, 1 << 62) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	/* os_posix_memalign() returns the error instead */
+	ptr = NULL;
+	ret = os_posix_memalign(&ptr, 64, 1000);
+	FAIL(ret || !ptr || !is_aligned(ptr, 64), "DBG: os_posix_memalign failed on valid arguments");
+	os_free(ptr);
+	printf("os_posix_memalign(64, 1000) = %s\n", err_name(ret));
+
+	ptr = NULL;
+	ret = os_posix_memalign(&ptr, 0, 1000);
+	printf("os_posix_memalign(0, 1000) = %s\n", err_name(ret));
+	FAIL(ptr, "DBG: os_posix_memalign set memptr on failure");
+
+	ret = os_posix_memalign(&ptr, 4, 1000);
+	printf("os_posix_memalign(4, 1000) = %s\n", err_name(ret));
+
+	ret = os_posix_memalign(&ptr, 24, 1000);
+	printf("os_posix_memalign(24, 1000) = %s\n", err_name(ret));
+
+	ret = os_posix_memalign(&ptr, 4096, SIZE_MAX / 2);
+	printf("os_posix_memalign(4096, SIZE_MAX / 2) = %s\n", err_name(ret));
+	FAIL(ptr, "DBG: os_posix_memalign set memptr on failure");
+
+	return 0;
+}
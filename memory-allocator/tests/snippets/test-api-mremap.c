@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+#include "test-utils.h"
+
+/* Run with OSMEM_MREMAP=1, as run_tests.py does */
+#define PAGE 4096
+
+struct os_malloc_stats stats;
+
+// obtain the mremap calls made so far
+unsigned long mremaps(void)
+{
+	os_malloc_stats(&stats);
+	return stats.mremap_calls;
+}
+
+// fill size bytes of a block with a pattern of its offsets
+void fill(void *ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += 512)
+		((unsigned char *)ptr)[i] = (unsigned char)(i / 512);
+}
+
+// check that the first size bytes of a block still hold the pattern
+int kept(void *ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += 512)
+		if (((unsigned char *)ptr)[i] != (unsigned char)(i / 512))
+			return 0;
+	return 1;
+}
+
+int main(void)
+{
+	void *ptr, *again, *guard;
+	unsigned long before, munmaps;
+	size_t end;
+
+	/* Freed blocks keep the threshold where it is, below them */
+	os_mallopt(OS_M_MMAP_THRESHOLD, MMAP_THRESHOLD);
+
+	/* Growth remaps the block by half its length at least */
+	ptr = os_malloc_checked(200 * MULT_KB);
+	fill(ptr, 200 * MULT_KB);
+	before = mremaps();
+	ptr = os_realloc(ptr, 250 * MULT_KB);
+	FAIL(!ptr || mremaps() != before + 1, "DBG: os_realloc did not remap the block");
+	FAIL(os_malloc_usable_size(ptr) < 300 * MULT_KB, "DBG: os_realloc did not grow the block by half");
+	FAIL(!kept(ptr, 200 * MULT_KB), "DBG: os_realloc lost the contents");
+	fill(ptr, 250 * MULT_KB);
+	printf("os_realloc(250 KiB): remapped with room to grow\n");
+
+	/* Growth inside that room keeps the block where it is */
+	before = mremaps();
+	again = os_realloc(ptr, 290 * MULT_KB);
+	FAIL(again != ptr || mremaps() != before, "DBG: os_realloc did not grow inside the mapping");
+	FAIL(!kept(again, 250 * MULT_KB), "DBG: os_realloc lost the contents");
+	fill(again, 290 * MULT_KB);
+	printf("os_realloc(290 KiB): grown in place\n");
+
+	/* A mapping right after the block has it moved by the kernel */
+	end = ((uintptr_t)ptr + os_malloc_usable_size(ptr) + PAGE - 1) & ~(uintptr_t)(PAGE - 1);
+	guard = mmap((void *)end, PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	FAIL(guard == MAP_FAILED && errno != EEXIST, "DBG: mmap failed");
+	before = mremaps();
+	again = os_realloc(ptr, 1024 * MULT_KB);
+	FAIL(!again || again == ptr || mremaps() != before + 1, "DBG: os_realloc did not move the block");
+	FAIL(!kept(again, 290 * MULT_KB), "DBG: os_realloc lost the contents");
+	fill(again, 1024 * MULT_KB);
+	ptr = again;
+	if (guard != MAP_FAILED)
+		munmap(guard, PAGE);
+	printf("os_realloc(1024 KiB): moved\n");
+
+	/* Shrinking to half the mapping or less gives the end back */
+	before = mremaps();
+	munmaps = stats.munmap_calls;
+	again = os_realloc(ptr, 150 * MULT_KB);
+	FAIL(again != ptr || mremaps() != before + 1 || stats.munmap_calls != munmaps,
+	     "DBG: os_realloc did not shrink the block in place");
+	FAIL(os_malloc_usable_size(again) > 150 * MULT_KB + PAGE, "DBG: os_realloc kept the end of the block");
+	FAIL(!kept(again, 150 * MULT_KB), "DBG: os_realloc lost the contents");
+	printf("os_realloc(150 KiB): shrunk in place\n");
+
+	/* Less shrinking keeps the mapping as it is */
+	before = mremaps();
+	ptr = os_realloc(again, 140 * MULT_KB);
+	FAIL(ptr != again || mremaps() != before, "DBG: os_realloc remapped a block that shrank a little");
+	FAIL(!kept(ptr, 140 * MULT_KB), "DBG: os_realloc lost the contents");
+	os_free(ptr);
+	printf("os_realloc(140 KiB): kept in place\n");
+
+	return 0;
+}
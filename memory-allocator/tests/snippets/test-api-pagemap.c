@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+#include "../../src/heap.h"
+
+#define THREADS 2
+#define PAGES 5
+
+pthread_barrier_t allocated, checked;
+void *blocks[THREADS];
+
+/* Runs of pages page_map_walk() found pointing to the span looked for */
+struct walk {
+	struct span *span;
+	char *start;
+	size_t size;
+	int runs;
+};
+
+// note the runs of pages of one span
+void find_span(char *start, size_t size, struct span *span, void *arg)
+{
+	struct walk *walk = arg;
+
+	if (span != walk->span)
+		return;
+	walk->start = start;
+	walk->size = size;
+	walk->runs++;
+}
+
+// allocate a heap block from the arena of the thread, kept until the main thread looked it up
+void *worker(void *arg)
+{
+	long id = (long)arg;
+
+	blocks[id] = os_malloc_checked(1000);
+	pthread_barrier_wait(&allocated);
+	pthread_barrier_wait(&checked);
+	os_free(blocks[id]);
+	return NULL;
+}
+
+int main(void)
+{
+	struct span span = { .kind = SPAN_HEAP };
+	struct walk walk = { .span = &span };
+	pthread_t threads[THREADS];
+	char *pages;
+	void *ptr;
+	int seen = 0;
+
+	/* Pages set, looked up and cleared */
+	pages = mmap(NULL, PAGES * MAP_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	DIE(pages == MAP_FAILED, "mmap");
+
+	FAIL(page_map_set(pages + MAP_PAGE, 3 * MAP_PAGE, &span), "DBG: page_map_set failed");
+	FAIL(page_span(pages), "DBG: page before the range in the map");
+	for (int i = 1; i < 4; i++) {
+		FAIL(page_span(pages + i * MAP_PAGE) != &span, "DBG: page of the range not in the map");
+		FAIL(page_span(pages + i * MAP_PAGE + 100) != &span, "DBG: byte of the range not in the map");
+	}
+	FAIL(page_span(pages + 4 * MAP_PAGE), "DBG: page after the range in the map");
+	printf("page_map_set: 3 pages mapped\n");
+
+	page_map_walk(find_span, &walk);
+	printf("page_map_walk: %d run, %s, %zu pages\n", walk.runs,
+	       walk.start == pages + MAP_PAGE ? "at the range" : "elsewhere", walk.size / MAP_PAGE);
+
+	FAIL(page_map_set(pages + MAP_PAGE, 3 * MAP_PAGE, NULL), "DBG: page_map_set failed");
+	for (int i = 0; i < PAGES; i++)
+		FAIL(page_span(pages + i * MAP_PAGE), "DBG: cleared page still in the map");
+	walk.runs = 0;
+	page_map_walk(find_span, &walk);
+	printf("page_map_set(NULL): %d runs left\n", walk.runs);
+	munmap(pages, PAGES * MAP_PAGE);
+
+	/* Blocks of the sbrk heap, of segments and mmap'd ones */
+	ptr = os_malloc_checked(1000);
+	FAIL(!page_span(ptr) || page_span(ptr)->kind != SPAN_HEAP, "DBG: sbrk block not in the map");
+	printf("sbrk block: arena %d\n", (int)(page_span(ptr)->arena - arenas));
+	os_free(ptr);
+
+	ptr = os_malloc_checked(300 * MULT_KB);
+	printf("mmap'd block: %s\n", page_span(ptr) ? "in the map" : "not in the map");
+	os_free(ptr);
+
+	pthread_barrier_init(&allocated, NULL, THREADS + 1);
+	pthread_barrier_init(&checked, NULL, THREADS + 1);
+	for (long i = 0; i < THREADS; i++)
+		DIE(pthread_create(&threads[i], NULL, worker, (void *)i), "pthread_create");
+	pthread_barrier_wait(&allocated);
+	// the threads start in either order, one to each arena
+	for (int i = 0; i < THREADS; i++) {
+		struct span *found = page_span(blocks[i]);
+
+		FAIL(!found || found->kind != SPAN_HEAP, "DBG: thread block not in the map");
+		seen |= 1 << (found->arena - arenas);
+	}
+	printf("thread blocks: arenas %s\n", seen == 3 ? "0 and 1" : "other");
+	pthread_barrier_wait(&checked);
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_join(threads[i], NULL), "pthread_join");
+
+	return 0;
+}
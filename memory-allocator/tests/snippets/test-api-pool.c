@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+
+#define OBJECTS 5000
+#define POOLS 40
+
+void *objects[OBJECTS];
+struct os_pool *pools[POOLS];
+
+// free every other object from a thread of its own
+void *free_half(void *arg)
+{
+	struct os_pool *pool = arg;
+
+	for (int i = 0; i < OBJECTS; i += 2)
+		os_pool_free(pool, objects[i]);
+	return NULL;
+}
+
+// allocate the objects of a pool and check that they are aligned and apart
+void fill_pool(struct os_pool *pool, size_t size, size_t align)
+{
+	for (int i = 0; i < OBJECTS; i++) {
+		objects[i] = os_pool_alloc(pool);
+		FAIL(!objects[i], "DBG: os_pool_alloc returned NULL");
+		FAIL(!is_aligned(objects[i], align), "DBG: os_pool_alloc returned a misaligned object");
+		memset(objects[i], i, size);
+	}
+	for (int i = 0; i < OBJECTS; i++)
+		for (size_t j = 0; j < size; j++)
+			FAIL(((unsigned char *)objects[i])[j] != (unsigned char)i, "DBG: os_pool_alloc objects overlap");
+}
+
+int main(void)
+{
+	struct os_malloc_stats before, after;
+	struct os_pool *pool;
+	pthread_t thread;
+
+	/* Objects kept per thread, handed back when the thread exits */
+	os_mallopt(OS_M_POOL_MAGAZINE, 32);
+
+	pool = os_pool_create(40, 0);
+	FAIL(!pool, "DBG: os_pool_create failed");
+	fill_pool(pool, 40, sizeof(void *));
+	printf("os_pool_alloc(40): aligned to %zu\n", sizeof(void *));
+
+	DIE(pthread_create(&thread, NULL, free_half, pool), "pthread_create");
+	DIE(pthread_join(thread, NULL), "pthread_join");
+	for (int i = 1; i < OBJECTS; i += 2)
+		os_pool_free(pool, objects[i]);
+	os_pool_free(pool, NULL);
+	printf("os_pool_free: freed from two threads\n");
+
+	// the freed objects are reused
+	fill_pool(pool, 40, sizeof(void *));
+	os_pool_destroy(pool);
+	printf("os_pool_destroy: freed the objects left\n");
+
+	pool = os_pool_create(100, 64);
+	FAIL(!pool, "DBG: os_pool_create failed");
+	fill_pool(pool, 100, 64);
+	os_pool_destroy(pool);
+	printf("os_pool_alloc(100, 64): aligned to 64\n");
+
+	/* Objects larger than a slab */
+	pool = os_pool_create(100 * MULT_KB, 0);
+	FAIL(!pool, "DBG: os_pool_create failed");
+	for (int i = 0; i < 20; i++) {
+		objects[i] = os_pool_alloc(pool);
+		FAIL(!objects[i], "DBG: os_pool_alloc returned NULL");
+		memset(objects[i], i, 100 * MULT_KB);
+	}
+	os_pool_destroy(pool);
+	printf("os_pool_alloc(100 KiB): allocated\n");
+
+	/* Each pool has a magazine of its own, which no other pool evicts */
+	for (int i = 0; i < POOLS; i++) {
+		pools[i] = os_pool_create(1000, 0);
+		FAIL(!pools[i], "DBG: os_pool_create failed");
+		objects[i] = os_pool_alloc(pools[i]);
+		FAIL(!objects[i], "DBG: os_pool_alloc returned NULL");
+		memset(objects[i], i, 1000);
+	}
+	os_malloc_stats(&before);
+	for (int i = 0; i < POOLS; i++) {
+		FAIL(((unsigned char *)objects[i])[999] != (unsigned char)i, "DBG: os_pool_alloc objects overlap");
+		os_pool_free(pools[i], objects[i]);
+	}
+	os_malloc_stats(&after);
+	FAIL(after.madvise_calls != before.madvise_calls, "DBG: a pool emptied its slab through another magazine");
+	for (int i = 0; i < POOLS; i++)
+		os_pool_destroy(pools[i]);
+	printf("os_pool_free: %d pools keep their magazines\n", POOLS);
+
+	/* A pool that empties keeps its last slab, with the pages past the header given back */
+	os_mallopt(OS_M_POOL_MAGAZINE, 0);
+	pool = os_pool_create(1000, 0);
+	FAIL(!pool, "DBG: os_pool_create failed");
+	fill_pool(pool, 1000, sizeof(void *));
+	os_malloc_stats(&before);
+	for (int i = 0; i < OBJECTS; i++)
+		os_pool_free(pool, objects[i]);
+	os_malloc_stats(&after);
+	FAIL(after.munmap_calls == before.munmap_calls, "DBG: os_pool_free kept the empty slabs");
+	FAIL(after.madvise_calls != before.madvise_calls + 1, "DBG: os_pool_free kept the pages of the last slab");
+	fill_pool(pool, 1000, sizeof(void *));
+	os_pool_destroy(pool);
+	printf("os_pool_free: last slab given back\n");
+
+	/* Sizes and alignments that cannot be met */
+	printf("os_pool_create(0, 0) = %s\n", os_pool_create(0, 0) ? "pool" : "NULL");
+	printf("os_pool_create(100, 48) = %s\n", os_pool_create(100, 48) ? "pool" : "NULL");
+	printf("os_pool_create(100, 16384) = %s\n", os_pool_create(100, 16384) ? "pool" : "NULL");
+	printf("os_pool_create(SIZE_MAX / 8 + 100, 0) = %s\n", os_pool_create(SIZE_MAX / 8 + 100, 0) ? "pool" : "NULL");
+	printf("os_pool_create(SIZE_MAX - 2, 0) = %s\n", os_pool_create(SIZE_MAX - 2, 0) ? "pool" : "NULL");
+
+	os_pool_destroy(NULL);
+	printf("os_pool_destroy(NULL): ignored\n");
+
+	return 0;
+}
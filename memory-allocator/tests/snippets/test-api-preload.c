@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <malloc.h>
+#include "test-utils.h"
+
+#define ALIGN 16
+
+size_t sizes[] = {0, 1, 7, 24, 100, 1000, 5000, 100 * MULT_KB, 300 * MULT_KB};
+
+// name the library a function the program calls is taken from
+const char *library_of(const char *symbol)
+{
+	void *fn = dlsym(RTLD_DEFAULT, symbol);
+	Dl_info info;
+
+	if (!fn || !dladdr(fn, &info) || !info.dli_fname)
+		return "none";
+	return strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+}
+
+int main(void)
+{
+	void *(*new_nothrow)(size_t size, const void *tag);
+	void *(*new_aligned)(size_t size, size_t align);
+	void (*delete_aligned)(void *ptr, size_t align);
+	void *(*new)(size_t size);
+	void (*delete)(void *ptr);
+	volatile size_t huge = SIZE_MAX - 100;
+	void *ptr;
+	int ret;
+
+	printf("malloc from %s\n", library_of("malloc"));
+	printf("free from %s\n", library_of("free"));
+	printf("operator new from %s\n", library_of("_Znwm"));
+
+	/* Only the allocator and the os_* API are exported */
+	void *preload = dlopen("libosmem_preload.so", RTLD_NOW | RTLD_NOLOAD);
+	const char *internals[] = {"tunable", "arenas", "do_malloc", "heap_free", "printf_"};
+
+	FAIL(!preload, "DBG: libosmem_preload.so not loaded");
+	for (unsigned int i = 0; i < sizeof(internals) / sizeof(internals[0]); i++)
+		printf("%s exported: %s\n", internals[i], dlsym(preload, internals[i]) ? "yes" : "no");
+	printf("os_malloc exported: %s\n", dlsym(preload, "os_malloc") ? "yes" : "no");
+	dlclose(preload);
+
+	/* Blocks aligned for any type, and a unique one for 0 bytes */
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		void *blocks[4];
+
+		blocks[0] = malloc(sizes[i]);
+		blocks[1] = calloc(1, sizes[i]);
+		blocks[2] = realloc(NULL, sizes[i]);
+		blocks[3] = realloc(malloc(3), sizes[i] + 1);
+		for (int j = 0; j < 4; j++) {
+			FAIL(!blocks[j], "DBG: allocation returned NULL on valid size");
+			FAIL(!is_aligned(blocks[j], ALIGN), "DBG: allocation not aligned to 16 bytes");
+			FAIL(malloc_usable_size(blocks[j]) < sizes[i], "DBG: malloc_usable_size below the size");
+		}
+		for (size_t j = 0; j < sizes[i]; j++)
+			FAIL(((char *)blocks[1])[j], "DBG: calloc returned uninitialized memory");
+		for (int j = 0; j < 4; j++)
+			free(blocks[j]);
+	}
+	printf("malloc, calloc, realloc: aligned to %d\n", ALIGN);
+
+	ptr = aligned_alloc(4096, 100);
+	FAIL(!ptr || !is_aligned(ptr, 4096), "DBG: aligned_alloc returned a misaligned block");
+	free(ptr);
+	ptr = memalign(64, 100);
+	FAIL(!ptr || !is_aligned(ptr, 64), "DBG: memalign returned a misaligned block");
+	free(ptr);
+	printf("aligned_alloc, memalign: aligned\n");
+
+	/* operator new and delete */
+	new = dlsym(RTLD_DEFAULT, "_Znwm");
+	delete = dlsym(RTLD_DEFAULT, "_ZdlPv");
+	new_nothrow = dlsym(RTLD_DEFAULT, "_ZnwmRKSt9nothrow_t");
+	new_aligned = dlsym(RTLD_DEFAULT, "_ZnwmSt11align_val_t");
+	delete_aligned = dlsym(RTLD_DEFAULT, "_ZdlPvSt11align_val_t");
+	FAIL(!new || !delete || !new_nothrow || !new_aligned || !delete_aligned, "DBG: operator new missing");
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ptr = new(sizes[i]);
+		FAIL(!ptr || !is_aligned(ptr, ALIGN), "DBG: operator new not aligned to 16 bytes");
+		delete(ptr);
+	}
+	ptr = new_aligned(100, 256);
+	FAIL(!ptr || !is_aligned(ptr, 256), "DBG: aligned operator new returned a misaligned block");
+	delete_aligned(ptr, 256);
+	printf("operator new: aligned to %d\n", ALIGN);
+
+	/* Sizes too large to allocate */
+	errno = 0;
+	ptr = malloc(huge);
+	printf("malloc(SIZE_MAX - 100) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	errno = 0;
+	ptr = calloc(huge / 2, 4);
+	printf("calloc(SIZE_MAX / 2, 4) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	// through its symbol, as the block is freed after the failed realloc
+	void *(*resize)(void *ptr, size_t size) = dlsym(RTLD_DEFAULT, "realloc");
+	void *block = malloc(100);
+
+	errno = 0;
+	ptr = resize(block, huge);
+	printf("realloc(block, SIZE_MAX - 100) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+	free(ptr ? ptr : block);
+
+	errno = 0;
+	ptr = reallocarray(NULL, huge / 2, 4);
+	printf("reallocarray(NULL, SIZE_MAX / 2, 4) = %s, errno %s\n", ptr ? "block" : "NULL", err_name(errno));
+
+	ptr = new_nothrow(huge, NULL);
+	printf("operator new(SIZE_MAX - 100, nothrow) = %s\n", ptr ? "block" : "NULL");
+
+	ret = posix_memalign(&ptr, 0, 100);
+	printf("posix_memalign(0, 100) = %s\n", err_name(ret));
+
+	ret = posix_memalign(&ptr, 64, huge);
+	printf("posix_memalign(64, SIZE_MAX - 100) = %s\n", err_name(ret));
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define ALLOCS 100
+
+// dump a profile to path and read back its live allocations, total ones and sampling period
+void read_profile(const char *path, unsigned long *live, unsigned long *total, int *period)
+{
+	char buf[256];
+	ssize_t len;
+	int fd;
+
+	FAIL(os_malloc_prof_dump(path), "DBG: os_malloc_prof_dump failed");
+
+	fd = open(path, O_RDONLY);
+	DIE(fd < 0, "open");
+	len = read(fd, buf, sizeof(buf) - 1);
+	DIE(len < 0, "read");
+	buf[len] = '\0';
+	close(fd);
+
+	FAIL(sscanf(buf, "heap profile: %lu: %*u [%lu: %*u] @ heap_v2/%d", live, total, period) != 3,
+	     "DBG: os_malloc_prof_dump wrote no profile header");
+}
+
+int main(void)
+{
+	void *ptrs[ALLOCS];
+	unsigned long live, total;
+	char path[64];
+	int period, ret;
+
+	snprintf(path, sizeof(path), "/tmp/test-api-prof.%d.heap", (int)getpid());
+
+	/* Sampling every allocation */
+	os_mallopt(OS_M_PROF_SAMPLE, 1);
+
+	for (int i = 0; i < ALLOCS; i++) {
+		ptrs[i] = os_malloc_checked(1000);
+		memset(ptrs[i], i, 1000);
+	}
+
+	read_profile(path, &live, &total, &period);
+	FAIL(!live, "DBG: os_malloc_prof_dump shows no live allocations");
+	printf("os_malloc_prof_dump: live allocations, heap_v2/%d\n", period);
+
+	for (int i = 0; i < ALLOCS; i++) {
+		for (int j = 0; j < 1000; j++)
+			FAIL(((unsigned char *)ptrs[i])[j] != (unsigned char)i, "DBG: sampled blocks overlap");
+		os_free(ptrs[i]);
+	}
+
+	read_profile(path, &live, &total, &period);
+	FAIL(live, "DBG: os_malloc_prof_dump shows freed allocations as live");
+	FAIL(!total, "DBG: os_malloc_prof_dump lost the allocations made");
+	printf("os_malloc_prof_dump: no live allocations after the frees\n");
+	unlink(path);
+
+	errno = 0;
+	ret = os_malloc_prof_dump("/nonexistent/test-api-prof.heap");
+	printf("os_malloc_prof_dump(/nonexistent) = %d, errno %s\n", ret, err_name(errno));
+
+	return 0;
+}
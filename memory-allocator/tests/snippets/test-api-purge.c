@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <unistd.h>
+#include <time.h>
+#include "test-utils.h"
+
+/*
+ * Run with OSMEM_PURGE_INTERVAL=20, OSMEM_DIRTY_DECAY=100,
+ * OSMEM_MUZZY_DECAY=200 and OSMEM_LARGE_CACHE=4 MiB, as run_tests.py does
+ */
+#define BLOCK (100 * MULT_KB)
+#define WAIT_MS 5000
+
+struct os_purge_stats stats;
+
+// wait for the purger to have given back pages in one of its counters, 0 on timeout
+int wait_for(unsigned long *counter)
+{
+	for (int waited = 0; waited < WAIT_MS; waited += 10) {
+		os_malloc_purge_stats(&stats);
+		if (*counter)
+			return 1;
+		nanosleep(&(struct timespec){ .tv_nsec = 10 * 1000000L }, NULL);
+	}
+	return 0;
+}
+
+int main(void)
+{
+	void *ptr, *guard, *top;
+	unsigned long purged;
+	size_t pages;
+	char *end;
+
+	/*
+	 * Start the purger before the sbrk heap: creating its thread has glibc
+	 * malloc take memory off the break, above which the heap is trimmable
+	 */
+	os_free(os_malloc_checked(1024 * MULT_KB));
+
+	/* Freed pages stay dirty until the decay, in use or not */
+	ptr = os_malloc_checked(BLOCK);
+	guard = os_malloc_checked(MULT_KB);
+	top = os_malloc_checked(BLOCK);
+	memset(ptr, 1, BLOCK);
+	memset(guard, 2, MULT_KB);
+	memset(top, 3, BLOCK);
+	end = sbrk(0);
+	os_free(ptr);
+	os_free(top);
+	os_malloc_purge_stats(&stats);
+	FAIL(stats.pages_muzzy || stats.pages_purged, "DBG: the purger took pages before the dirty decay");
+	printf("os_free(%d KiB): pages dirty\n", BLOCK / MULT_KB);
+
+	/* Then the purger has them MADV_FREE'd, then MADV_DONTNEED'd */
+	FAIL(!wait_for(&stats.pages_muzzy), "DBG: the purger did not make the pages muzzy");
+	printf("after OSMEM_DIRTY_DECAY: pages muzzy\n");
+	FAIL(!wait_for(&stats.pages_purged), "DBG: the purger did not give the pages back");
+	FAIL(!stats.passes, "DBG: os_malloc_purge_stats counted no passes");
+	for (int i = 0; i < MULT_KB; i++)
+		FAIL(((unsigned char *)guard)[i] != 2, "DBG: the purger took pages of a block in use");
+	printf("after OSMEM_MUZZY_DECAY: pages given back\n");
+
+	/* A free top that decays is cut off the sbrk heap instead */
+	FAIL(!wait_for(&stats.pages_trimmed), "DBG: the purger did not trim the heap");
+	FAIL((char *)sbrk(0) >= end, "DBG: the purger did not move the break down");
+	printf("free top: heap trimmed\n");
+
+	/* With the purger stopped, os_malloc_purge gives everything back at once */
+	os_mallopt(OS_M_PURGE_INTERVAL, 0);
+	ptr = os_malloc_checked(BLOCK);
+	FAIL(ptr >= guard, "DBG: os_malloc did not reuse the purged block");
+	memset(ptr, 4, BLOCK);
+	os_free(ptr);
+	os_malloc_purge_stats(&stats);
+	purged = stats.pages_purged;
+	pages = os_malloc_purge();
+	os_malloc_purge_stats(&stats);
+	FAIL(!pages || stats.pages_purged - purged != pages, "DBG: os_malloc_purge did not give the dirty pages back");
+	printf("os_malloc_purge: dirty pages given back\n");
+
+	/* and unmaps the cached mmap'd blocks */
+	ptr = os_malloc_checked(1024 * MULT_KB);
+	os_free(ptr);
+	os_malloc_purge();
+	os_malloc_purge_stats(&stats);
+	FAIL(stats.large_released < 1024 * MULT_KB, "DBG: os_malloc_purge kept the cached blocks");
+	printf("os_malloc_purge: cached blocks unmapped\n");
+
+	os_free(guard);
+	return 0;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define ALLOCS 1000
+
+int main(void)
+{
+	static void *ptrs[ALLOCS];
+	struct os_arena *region;
+	void *first, *ptr;
+
+	region = os_arena_create(0);
+	FAIL(!region, "DBG: os_arena_create failed");
+
+	/* Allocations past the first chunks, each aligned and apart */
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < ALLOCS; i++) {
+			size_t size = inc_sz_sm[i % NUM_SZ_SM];
+
+			ptrs[i] = os_arena_alloc(region, size);
+			FAIL(!ptrs[i], "DBG: os_arena_alloc returned NULL on valid size");
+			FAIL(!is_aligned(ptrs[i], 16), "DBG: os_arena_alloc not aligned to 16 bytes");
+			memset(ptrs[i], i, size);
+		}
+		for (int i = 0; i < ALLOCS; i++)
+			for (int j = 0; j < inc_sz_sm[i % NUM_SZ_SM]; j++)
+				FAIL(((unsigned char *)ptrs[i])[j] != (unsigned char)i, "DBG: os_arena_alloc blocks overlap");
+
+		// the reset hands out the same memory again
+		first = ptrs[0];
+		os_arena_reset(region);
+		ptr = os_arena_alloc(region, 10);
+		FAIL(ptr != first, "DBG: os_arena_reset did not reuse the first chunk");
+		os_arena_reset(region);
+	}
+	printf("os_arena_alloc: aligned, reused after os_arena_reset\n");
+
+	ptr = os_arena_aligned_alloc(region, 4096, 100);
+	FAIL(!ptr || !is_aligned(ptr, 4096), "DBG: os_arena_aligned_alloc returned a misaligned block");
+
+	/* Larger than a chunk, in a block of its own */
+	ptr = os_arena_aligned_alloc(region, 64, 1024 * MULT_KB);
+	FAIL(!ptr || !is_aligned(ptr, 64), "DBG: os_arena_aligned_alloc returned a misaligned large block");
+	memset(ptr, 0, 1024 * MULT_KB);
+	os_arena_reset(region);
+	printf("os_arena_aligned_alloc: aligned\n");
+
+	/* Sizes and alignments that cannot be met */
+	printf("os_arena_alloc(0) = %s\n", os_arena_alloc(region, 0) ? "block" : "NULL");
+	printf("os_arena_alloc(SIZE_MAX - 100) = %s\n", os_arena_alloc(region, SIZE_MAX - 100) ? "block" : "NULL");
+	printf("os_arena_aligned_alloc(0, 100) = %s\n", os_arena_aligned_alloc(region, 0, 100) ? "block" : "NULL");
+	printf("os_arena_aligned_alloc(48, 100) = %s\n", os_arena_aligned_alloc(region, 48, 100) ? "block" : "NULL");
+	os_arena_destroy(region);
+
+	/* Chunks of a given size */
+	region = os_arena_create(1000);
+	FAIL(!region, "DBG: os_arena_create failed");
+	for (int i = 0; i < ALLOCS; i++)
+		FAIL(!os_arena_alloc(region, 100), "DBG: os_arena_alloc returned NULL on valid size");
+	os_arena_destroy(region);
+	printf("os_arena_create(1000): grows past its chunk\n");
+
+	os_arena_destroy(NULL);
+	printf("os_arena_destroy(NULL): ignored\n");
+
+	return 0;
+}
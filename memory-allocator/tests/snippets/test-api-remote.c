@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+#include "../../src/heap.h"
+
+/* Run with OSMEM_REMOTE_FREE=1, OSMEM_ARENAS=2 and OSMEM_TCACHE=0, as run_tests.py does */
+#define BLOCKS 100
+#define ROUNDS 10
+#define SIZE 256
+
+void *blocks[BLOCKS];
+pthread_barrier_t produced, consumed, drained;
+int producer_arena;
+
+// obtain the index of the arena a heap block belongs to
+int arena_index(void *ptr)
+{
+	return page_span(ptr)->arena - arenas;
+}
+
+// obtain the blocks an arena took back from its remote list so far
+unsigned long remote_frees(int arena)
+{
+	struct os_arena_stats stats[MAX_ARENAS];
+
+	FAIL(os_malloc_arena_stats(stats, MAX_ARENAS) <= arena, "DBG: os_malloc_arena_stats missed an arena");
+	return stats[arena].remote_frees;
+}
+
+// allocate the blocks of each round, for the main thread to free
+void *producer(void *arg)
+{
+	(void)arg;
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int i = 0; i < BLOCKS; i++) {
+			blocks[i] = os_malloc_checked(SIZE);
+			memset(blocks[i], round, SIZE);
+		}
+		producer_arena = arena_index(blocks[0]);
+		pthread_barrier_wait(&produced);
+		pthread_barrier_wait(&consumed);
+
+		// the next allocation bins what the main thread freed
+		unsigned long before = remote_frees(producer_arena);
+		void *ptr = os_malloc_checked(SIZE);
+
+		FAIL(remote_frees(producer_arena) != before + BLOCKS, "DBG: os_malloc did not drain the remote frees");
+		os_free(ptr);
+		pthread_barrier_wait(&drained);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	void *mine;
+	unsigned long before;
+
+	/* Allocate first: the first thread in uses the sbrk heap until another one comes */
+	os_free(os_malloc_checked(SIZE));
+	pthread_barrier_init(&produced, NULL, 2);
+	pthread_barrier_init(&consumed, NULL, 2);
+	pthread_barrier_init(&drained, NULL, 2);
+	DIE(pthread_create(&thread, NULL, producer, NULL), "pthread_create");
+
+	for (int round = 0; round < ROUNDS; round++) {
+		pthread_barrier_wait(&produced);
+		mine = os_malloc_checked(SIZE);
+		FAIL(arena_index(mine) == producer_arena, "DBG: the threads share an arena");
+
+		/* Blocks of the other arena go onto its remote list, untouched until it allocates */
+		before = remote_frees(producer_arena);
+		for (int i = 0; i < BLOCKS; i++) {
+			for (int j = 0; j < SIZE; j++)
+				FAIL(((unsigned char *)blocks[i])[j] != (unsigned char)round, "DBG: producer blocks overlap");
+			os_free(blocks[i]);
+		}
+		FAIL(remote_frees(producer_arena) != before, "DBG: os_free binned blocks of another arena");
+		os_free(mine);
+		pthread_barrier_wait(&consumed);
+		pthread_barrier_wait(&drained);
+	}
+	DIE(pthread_join(thread, NULL), "pthread_join");
+	printf("%d rounds of %d blocks freed across arenas: drained on the next allocation\n", ROUNDS, BLOCKS);
+	printf("remote_frees of the producer arena: %lu\n", remote_frees(producer_arena));
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+size_t sizes[] = {1, 24, 100, 4000, 100 * MULT_KB, 300 * MULT_KB};
+
+int main(void)
+{
+	void *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+	size_t usable;
+
+	/* Slabs serve the small sizes, the heap and mmap'd blocks the others */
+	os_mallopt(OS_M_SLAB, 1);
+
+	printf("os_malloc_usable_size(NULL) = %zu\n", os_malloc_usable_size(NULL));
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ptrs[i] = os_malloc_checked(sizes[i]);
+		usable = os_malloc_usable_size(ptrs[i]);
+		FAIL(usable < sizes[i], "DBG: os_malloc_usable_size below the size allocated");
+		FAIL(usable > sizes[i] + 4096, "DBG: os_malloc_usable_size far past the size allocated");
+
+		// all of the usable bytes belong to the block
+		memset(ptrs[i], 0x5a, usable);
+		printf("os_malloc(%zu): usable size covers it\n", sizes[i]);
+	}
+
+	/* The blocks around stay intact while the others are freed by size */
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 2)
+		os_free_sized(ptrs[i], sizes[i]);
+
+	for (unsigned int i = 1; i < sizeof(sizes) / sizeof(sizes[0]); i += 2) {
+		usable = os_malloc_usable_size(ptrs[i]);
+		for (size_t j = 0; j < usable; j++)
+			FAIL(((unsigned char *)ptrs[i])[j] != 0x5a, "DBG: os_free_sized corrupted another block");
+		os_free_sized(ptrs[i], sizes[i]);
+	}
+	printf("os_free_sized: freed all\n");
+
+	/* The freed blocks are reused */
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ptrs[i] = os_malloc_checked(sizes[i]);
+		FAIL(os_malloc_usable_size(ptrs[i]) < sizes[i], "DBG: os_malloc_usable_size below the size allocated");
+	}
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		os_free_sized(ptrs[i], sizes[i]);
+
+	os_free_sized(NULL, 100);
+	printf("os_free_sized(NULL): ignored\n");
+
+	return 0;
+}
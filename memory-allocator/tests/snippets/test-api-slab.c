@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define BLOCKS 200
+#define SLAB_PAGE 4096
+
+struct os_malloc_stats stats;
+
+// count the slabs in use
+size_t slabs(void)
+{
+	os_malloc_stats(&stats);
+	return stats.slab_size / SLAB_PAGE;
+}
+
+int main(void)
+{
+	void *ptrs[BLOCKS];
+	void *ptr, *again;
+	size_t before, count;
+
+	/* Slots of the size class, reused lowest first */
+	ptr = os_malloc_checked(20);
+	printf("os_malloc(20): usable size %zu\n", os_malloc_usable_size(ptr));
+	os_free(ptr);
+	again = os_malloc_checked(30);
+	printf("os_malloc(30) after os_free: %s slot\n", again == ptr ? "same" : "another");
+	os_free(again);
+
+	/* Slabs fill up, then empty and are given back but one */
+	before = slabs();
+	for (int i = 0; i < BLOCKS; i++) {
+		ptrs[i] = os_malloc_checked(64);
+		memset(ptrs[i], i, 64);
+	}
+	printf("%d blocks of 64 bytes: %zu more slabs\n", BLOCKS, slabs() - before);
+	for (int i = 0; i < BLOCKS; i++)
+		for (int j = 0; j < 64; j++)
+			FAIL(((unsigned char *)ptrs[i])[j] != (unsigned char)i, "DBG: slab slots overlap");
+
+	// a full slab takes slots again once one is freed
+	os_free(ptrs[10]);
+	ptrs[10] = os_malloc_checked(64);
+	FAIL(slabs() - before != (BLOCKS + 61) / 62, "DBG: a freed slot of a full slab was not reused");
+
+	for (int i = 0; i < BLOCKS; i++)
+		os_free_sized(ptrs[i], 64);
+	count = slabs() - before;
+	printf("after os_free_sized: %zu more slabs, %zu bytes in use\n", count, stats.in_use);
+
+	/* realloc moves between slab slots and heap blocks, keeping the contents */
+	ptr = os_malloc_checked(16);
+	memset(ptr, 0x11, 16);
+	ptr = os_realloc(ptr, 100);
+	FAIL(!ptr, "DBG: os_realloc returned NULL on valid size");
+	for (int j = 0; j < 16; j++)
+		FAIL(((unsigned char *)ptr)[j] != 0x11, "DBG: os_realloc lost the slot contents");
+	memset(ptr, 0x22, 100);
+	ptr = os_realloc(ptr, 5000);
+	FAIL(!ptr, "DBG: os_realloc returned NULL on valid size");
+	for (int j = 0; j < 100; j++)
+		FAIL(((unsigned char *)ptr)[j] != 0x22, "DBG: os_realloc lost the slot contents");
+	printf("os_realloc: slot to slot to heap block\n");
+
+	ptr = os_realloc(ptr, 40);
+	FAIL(!ptr, "DBG: os_realloc returned NULL on valid size");
+	for (int j = 0; j < 40; j++)
+		FAIL(((unsigned char *)ptr)[j] != 0x22, "DBG: os_realloc lost the block contents");
+	os_free(ptr);
+	printf("os_realloc: heap block shrunk\n");
+
+	ptr = os_calloc_checked(4, 8);
+	printf("os_calloc(4, 8): usable size %zu\n", os_malloc_usable_size(ptr));
+	os_free(ptr);
+
+	return 0;
+}
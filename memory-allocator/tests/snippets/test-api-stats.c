@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+// count the heap blocks and slab slots in use, of all sizes
+unsigned long used_blocks(struct os_malloc_stats *stats)
+{
+	unsigned long used = 0;
+
+	for (int i = 0; i < OS_STATS_CLASSES; i++)
+		used += stats->used_blocks[i];
+	return used;
+}
+
+int main(void)
+{
+	struct os_malloc_stats before, during, after;
+	char buf[4096];
+	int fds[2];
+	ssize_t len;
+	void *small, *large;
+
+	os_malloc_stats(&before);
+	printf("mmap_threshold = %zu\n", before.mmap_threshold);
+
+	small = os_malloc_checked(1000);
+	large = os_malloc_checked(200 * MULT_KB);
+
+	os_malloc_stats(&during);
+	FAIL(during.in_use < before.in_use + 1000 + 200 * MULT_KB, "DBG: in_use misses the blocks allocated");
+	FAIL(during.mapped_blocks != before.mapped_blocks + 1, "DBG: mapped_blocks misses the mmap'd block");
+	FAIL(during.mapped < before.mapped + 200 * MULT_KB, "DBG: mapped misses the mmap'd block");
+	FAIL(during.mmap_calls <= before.mmap_calls, "DBG: mmap_calls misses the mmap'd block");
+	FAIL(used_blocks(&during) != used_blocks(&before) + 1, "DBG: used_blocks misses the heap block");
+	FAIL(during.sbrk_size < 1000, "DBG: sbrk_size misses the heap");
+	printf("os_malloc_stats: counts the blocks allocated\n");
+
+	os_free(small);
+	os_free(large);
+
+	os_malloc_stats(&after);
+	FAIL(after.in_use != before.in_use, "DBG: in_use keeps freed blocks");
+	FAIL(after.mapped_blocks != before.mapped_blocks, "DBG: mapped_blocks keeps the freed mmap'd block");
+	FAIL(after.munmap_calls <= before.munmap_calls, "DBG: munmap_calls misses the freed mmap'd block");
+	FAIL(used_blocks(&after) != used_blocks(&before), "DBG: used_blocks keeps the freed heap block");
+	FAIL(after.sbrk_free < 1000, "DBG: sbrk_free misses the freed heap block");
+	FAIL(after.largest_free > after.sbrk_free + after.segment_free, "DBG: largest_free past the free bytes");
+	printf("os_malloc_stats: counts the blocks freed\n");
+
+	/* The text dump, through a pipe */
+	DIE(pipe(fds) < 0, "pipe");
+	os_malloc_stats_print(fds[1]);
+	close(fds[1]);
+	len = read(fds[0], buf, sizeof(buf) - 1);
+	DIE(len < 0, "read");
+	buf[len] = '\0';
+	close(fds[0]);
+
+	FAIL(strncmp(buf, "in use:", 7), "DBG: os_malloc_stats_print wrote no stats");
+	FAIL(!strstr(buf, "mmap threshold: 131072 bytes\n"), "DBG: os_malloc_stats_print left out the threshold");
+	printf("os_malloc_stats_print: wrote the stats\n");
+
+	return 0;
+}
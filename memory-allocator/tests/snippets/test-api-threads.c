@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include "test-utils.h"
+
+#define THREADS 4
+#define ROUNDS 20000
+#define SLOTS 64
+#define FORKS 20
+
+/* Blocks handed from each thread to the next one, which frees them */
+void *handoff[THREADS][SLOTS];
+pthread_mutex_t handoff_mutex[THREADS];
+int stop;
+
+// pick the next of a sequence of pseudo-random numbers
+unsigned int next_random(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+// check that a block still holds the bytes it was filled with
+void check_block(unsigned char *ptr, size_t size, unsigned char fill)
+{
+	for (size_t i = 0; i < size; i++)
+		FAIL(ptr[i] != fill, "DBG: block corrupted by another thread");
+}
+
+// allocate, resize and free blocks, handing some to the next thread to free
+void *worker(void *arg)
+{
+	int id = (int)(long)arg;
+	unsigned int seed = id + 1;
+	void *own[SLOTS] = { NULL };
+	size_t sizes[SLOTS] = { 0 };
+
+	for (int round = 0; round < ROUNDS; round++) {
+		unsigned int slot = next_random(&seed) % SLOTS;
+		size_t size = next_random(&seed) % 2000 + 1;
+		unsigned char fill = id * SLOTS + slot;
+
+		if (own[slot]) {
+			check_block(own[slot], sizes[slot], fill);
+			if (round % 3) {
+				own[slot] = os_realloc(own[slot], size);
+				FAIL(!own[slot], "DBG: os_realloc returned NULL on valid size");
+				check_block(own[slot], MIN(size, sizes[slot]), fill);
+			} else {
+				os_free(own[slot]);
+				own[slot] = os_malloc_checked(size);
+			}
+		} else {
+			own[slot] = os_malloc_checked(size);
+		}
+		sizes[slot] = size;
+		memset(own[slot], fill, size);
+
+		// the block of the previous thread in this slot is freed here
+		pthread_mutex_lock(&handoff_mutex[id]);
+		os_free(handoff[id][slot]);
+		handoff[id][slot] = NULL;
+		pthread_mutex_unlock(&handoff_mutex[id]);
+
+		pthread_mutex_lock(&handoff_mutex[(id + 1) % THREADS]);
+		if (!handoff[(id + 1) % THREADS][slot]) {
+			handoff[(id + 1) % THREADS][slot] = own[slot];
+			own[slot] = NULL;
+		}
+		pthread_mutex_unlock(&handoff_mutex[(id + 1) % THREADS]);
+	}
+
+	for (int slot = 0; slot < SLOTS; slot++)
+		os_free(own[slot]);
+	return NULL;
+}
+
+// keep the locks of the allocator busy while the main thread forks
+void *churn(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		void *ptrs[16];
+
+		for (int i = 0; i < 16; i++)
+			ptrs[i] = os_malloc_checked(16 << (i % 10));
+		for (int i = 0; i < 16; i++)
+			os_free(ptrs[i]);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[THREADS];
+	struct os_malloc_stats stats;
+	void *ptr;
+
+	/* The thread caches turn on once a second thread allocates */
+	ptr = os_malloc_checked(100);
+	os_free(ptr);
+	os_malloc_stats(&stats);
+	printf("one thread: thread caches %s\n", stats.thread_cached ? "used" : "unused");
+
+	for (int i = 0; i < THREADS; i++)
+		pthread_mutex_init(&handoff_mutex[i], NULL);
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_create(&threads[i], NULL, worker, (void *)(long)i), "pthread_create");
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_join(threads[i], NULL), "pthread_join");
+	for (int i = 0; i < THREADS; i++)
+		for (int slot = 0; slot < SLOTS; slot++)
+			os_free(handoff[i][slot]);
+	printf("%d threads: malloc, realloc and free across threads\n", THREADS);
+
+	ptr = os_malloc_checked(100);
+	os_free(ptr);
+	os_malloc_stats(&stats);
+	printf("more threads: thread caches %s\n", stats.thread_cached ? "used" : "unused");
+
+	/* Children forked while other threads hold the locks can allocate */
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_create(&threads[i], NULL, churn, NULL), "pthread_create");
+	for (int i = 0; i < FORKS; i++) {
+		int status;
+		pid_t pid = fork();
+
+		DIE(pid < 0, "fork");
+		if (!pid) {
+			// a lock left held would hang the child
+			alarm(10);
+			for (int j = 0; j < 100; j++) {
+				ptr = os_malloc_checked(16 << (j % 14));
+				ptr = os_realloc(ptr, 100);
+				FAIL(!ptr, "DBG: os_realloc returned NULL on valid size");
+				os_free(ptr);
+			}
+			exit(0);
+		}
+		DIE(waitpid(pid, &status, 0) < 0, "waitpid");
+		FAIL(!WIFEXITED(status) || WEXITSTATUS(status), "DBG: forked child failed to allocate");
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < THREADS; i++)
+		DIE(pthread_join(threads[i], NULL), "pthread_join");
+	printf("fork: %d children allocated while threads held the locks\n", FORKS);
+
+	return 0;
+}
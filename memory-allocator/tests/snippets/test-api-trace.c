@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define RECORDS 16
+
+const char *op_names[] = {"malloc", "free", "calloc", "realloc", "memalign"};
+
+int main(void)
+{
+	struct os_trace_record records[RECORDS];
+	struct os_trace_header header;
+	char path[64];
+	void *ptr, *aligned;
+	ssize_t len;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "/tmp/test-api-trace.%d", (int)getpid());
+
+	errno = 0;
+	ret = os_malloc_trace_start("/nonexistent/test-api-trace");
+	printf("os_malloc_trace_start(/nonexistent) = %d, errno %s\n", ret, err_name(errno));
+
+	ret = os_malloc_trace_start(path);
+	printf("os_malloc_trace_start = %d\n", ret);
+
+	errno = 0;
+	ret = os_malloc_trace_start(path);
+	printf("os_malloc_trace_start again = %d, errno %s\n", ret, err_name(errno));
+
+	ptr = os_malloc_checked(100);
+	os_free(ptr);
+	ptr = os_calloc_checked(10, 20);
+	ptr = os_realloc(ptr, 1000);
+	aligned = os_memalign(64, 300);
+	os_malloc_trace_stop();
+
+	/* Not recorded once the trace stopped */
+	os_free(aligned);
+	os_free(ptr);
+	os_malloc_trace_stop();
+
+	fd = open(path, O_RDONLY);
+	DIE(fd < 0, "open");
+	len = read(fd, &header, sizeof(header));
+	FAIL(len != sizeof(header), "DBG: trace without a header");
+	FAIL(memcmp(header.magic, OS_TRACE_MAGIC, sizeof(header.magic)), "DBG: trace header without the magic");
+	printf("header: version %u, record size %u\n", header.version, header.record_size);
+
+	len = read(fd, records, sizeof(records));
+	DIE(len < 0, "read");
+	close(fd);
+	unlink(path);
+
+	for (size_t i = 0; i < len / sizeof(records[0]); i++) {
+		FAIL(records[i].op >= sizeof(op_names) / sizeof(op_names[0]), "DBG: trace record of no call");
+		FAIL(records[i].start > records[i].end, "DBG: trace record ends before it starts");
+		FAIL(i && records[i].start < records[i - 1].end, "DBG: trace records out of order");
+		FAIL(records[i].thread, "DBG: trace record of another thread");
+		printf("record %zu: %s, size %llu, %s\n", i, op_names[records[i].op],
+		       (unsigned long long)records[i].size, records[i].result ? "result" : "no result");
+	}
+
+	/* The trace can start again once stopped */
+	ret = os_malloc_trace_start(path);
+	printf("os_malloc_trace_start after stop = %d\n", ret);
+	os_malloc_trace_stop();
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <unistd.h>
+#include "test-utils.h"
+
+/* OSMEM_TRIM_THRESHOLD, as run_tests.py sets it */
+#define TRIM_THRESHOLD (64 * MULT_KB)
+#define BLOCK (100 * MULT_KB)
+#define BLOCKS 4
+
+struct os_malloc_stats stats;
+
+// fill a block with its index
+void fill(void *ptr, int i)
+{
+	memset(ptr, i, BLOCK);
+}
+
+// check that a block still holds its index
+int kept(void *ptr, int i)
+{
+	for (size_t j = 0; j < BLOCK; j++)
+		if (((unsigned char *)ptr)[j] != (unsigned char)i)
+			return 0;
+	return 1;
+}
+
+int main(void)
+{
+	void *ptrs[BLOCKS];
+	void *end, *ptr, *guard;
+	size_t size;
+	unsigned long madvises;
+
+	for (int i = 0; i < BLOCKS; i++) {
+		ptrs[i] = os_malloc_checked(BLOCK);
+		fill(ptrs[i], i);
+	}
+
+	/* A free top above the threshold moves the break down */
+	end = sbrk(0);
+	os_malloc_stats(&stats);
+	size = stats.sbrk_size;
+	os_free(ptrs[BLOCKS - 1]);
+	os_malloc_stats(&stats);
+	FAIL(sbrk(0) >= end, "DBG: os_free did not move the break down");
+	FAIL(stats.sbrk_size >= size - BLOCK + TRIM_THRESHOLD, "DBG: os_free did not shrink the heap");
+	FAIL((char *)sbrk(0) < (char *)ptrs[BLOCKS - 2] + BLOCK, "DBG: os_free trimmed blocks in use");
+	for (int i = 0; i < BLOCKS - 1; i++)
+		FAIL(!kept(ptrs[i], i), "DBG: os_free trimmed the contents of blocks in use");
+	printf("os_free(%d KiB) at the top: heap trimmed\n", BLOCK / MULT_KB);
+
+	/* The heap grows back at the same place */
+	ptrs[BLOCKS - 1] = os_malloc_checked(BLOCK);
+	FAIL(ptrs[BLOCKS - 1] < ptrs[BLOCKS - 2], "DBG: os_malloc did not grow the trimmed heap");
+	fill(ptrs[BLOCKS - 1], BLOCKS - 1);
+	printf("os_malloc(%d KiB): heap grown back\n", BLOCK / MULT_KB);
+
+	/* A free run inside the heap above the threshold has its pages given back */
+	os_malloc_stats(&stats);
+	madvises = stats.madvise_calls;
+	os_free(ptrs[1]);
+	os_malloc_stats(&stats);
+	FAIL(stats.madvise_calls != madvises + 1, "DBG: os_free did not madvise the free run");
+	for (int i = 0; i < BLOCKS; i += 2)
+		FAIL(!kept(ptrs[i], i), "DBG: os_free madvised the neighbours");
+	ptr = os_malloc_checked(BLOCK);
+	FAIL(ptr != ptrs[1], "DBG: os_malloc did not reuse the madvised run");
+	fill(ptr, 1);
+	printf("os_free(%d KiB) inside: pages given back\n", BLOCK / MULT_KB);
+
+	/* Free runs below the threshold keep their pages */
+	ptr = os_malloc_checked(TRIM_THRESHOLD / 2);
+	guard = os_malloc_checked(MULT_KB);
+	os_malloc_stats(&stats);
+	madvises = stats.madvise_calls;
+	os_free(ptr);
+	os_malloc_stats(&stats);
+	FAIL(stats.madvise_calls != madvises, "DBG: os_free madvised a run below the threshold");
+	printf("os_free(%d KiB) inside: pages kept\n", TRIM_THRESHOLD / 2 / MULT_KB);
+	os_free(guard);
+
+	return 0;
+}
@@ -105,3 +105,28 @@ void *mock_preallocate(void)
 {
 	return os_malloc(MOCK_PREALLOC);
 }
+
+// name an error number the API tests expect, for their output
+const char *err_name(int err)
+{
+	switch (err) {
+	case 0:
+		return "0";
+	case EINVAL:
+		return "EINVAL";
+	case ENOMEM:
+		return "ENOMEM";
+	case EBUSY:
+		return "EBUSY";
+	case ENOENT:
+		return "ENOENT";
+	default:
+		return "unexpected";
+	}
+}
+
+// check that ptr is aligned to align
+int is_aligned(void *ptr, size_t align)
+{
+	return ((uintptr_t)ptr & (align - 1)) == 0;
+}
@@ -15,7 +15,11 @@
 		}												\
 	} while (0)
 
-/* Structure to hold memory block metadata */
+/*
+ * Structure to hold memory block metadata
+ * On the sbrk heap, prev and next point to the physical neighbours of the block,
+ * so they double as its boundary tags and coalescing needs no list walk.
+ */
 struct block_meta {
 	size_t size;
 	size_t status;
@@ -27,3 +31,5 @@ struct block_meta {
 #define STATUS_FREE   0
 #define STATUS_ALLOC  1
 #define STATUS_MAPPED 2
+#define STATUS_CACHED 3
+#define STATUS_HUGETLB 4
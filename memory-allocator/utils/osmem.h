@@ -12,7 +12,217 @@
 #include "printf.h"
 #include <stdint.h>
 
+/*
+ * Alignment of the blocks of os_malloc() and the other calls without an
+ * alignment: 8 bytes, or 16 in libosmem_preload.so, which stands in for
+ * malloc() and so meets alignof(max_align_t)
+ */
+#ifndef OS_MALLOC_ALIGNMENT
+#define OS_MALLOC_ALIGNMENT 8
+#endif
+
 void *os_malloc(size_t size);
 void os_free(void *ptr);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+
+/*
+ * os_free() of a block allocated with size bytes: blocks of the sbrk heap and
+ * mmap'd blocks skip the page map lookup, slab slots and segment blocks do not
+ */
+void os_free_sized(void *ptr, size_t size);
+
+/* Bytes usable at ptr, at least the size it was allocated with */
+size_t os_malloc_usable_size(void *ptr);
+
+/*
+ * Allocate count blocks of size bytes into ptrs, carved out of as few
+ * free blocks as possible under one lock; returns the blocks allocated.
+ * Free them, or any other blocks, with os_free_batch().
+ */
+size_t os_malloc_batch(size_t size, size_t count, void **ptrs);
+void os_free_batch(void **ptrs, size_t count);
+
+/*
+ * Flags of os_malloc_flags(); the huge page ones apply to blocks large
+ * enough to be mmap'd, which are then rounded up to whole huge pages.
+ */
+#define OS_MALLOC_HUGEPAGE	0x1	/* align to 2 MiB and madvise(MADV_HUGEPAGE) */
+#define OS_MALLOC_HUGETLB	0x2	/* map with MAP_HUGETLB, or as above if that fails */
+#define OS_MALLOC_ZERO		0x4	/* zero the block, skipping pages known to be zero */
+
+void *os_malloc_flags(size_t size, int flags);
+
+/*
+ * Allocations aligned to align, a power of two, freed and resized like
+ * any other; os_posix_memalign() also wants a multiple of sizeof(void *)
+ * and returns EINVAL or ENOMEM instead of setting errno.
+ */
+void *os_memalign(size_t align, size_t size);
+void *os_aligned_alloc(size_t align, size_t size);
+int os_posix_memalign(void **memptr, size_t align, size_t size);
+
+/*
+ * Regions, for memory that dies together: allocations bump a pointer
+ * through chunks of the region and are not freed one by one.
+ * os_arena_reset() frees all of them at once and keeps the chunks for the
+ * allocations that follow, os_arena_destroy() also frees the chunks and
+ * the region. chunk_size is that of the first chunk, 0 for 64 KiB; later
+ * ones grow. Allocations are aligned to 16 bytes. A region is not locked;
+ * threads sharing one serialize the calls themselves.
+ */
+struct os_arena;
+
+struct os_arena *os_arena_create(size_t chunk_size);
+void *os_arena_alloc(struct os_arena *arena, size_t size);
+void *os_arena_aligned_alloc(struct os_arena *arena, size_t align, size_t size);
+void os_arena_reset(struct os_arena *arena);
+void os_arena_destroy(struct os_arena *arena);
+
+/*
+ * Pools of objects of one size, aligned to align (a power of two, 0 for
+ * that of a pointer), from slabs of their own: no header per object and no
+ * search. Pages of slabs that empty are given back. os_pool_destroy() frees
+ * all objects of the pool at once. Any thread may use a pool.
+ */
+struct os_pool;
+
+struct os_pool *os_pool_create(size_t obj_size, size_t align);
+void *os_pool_alloc(struct os_pool *pool);
+void os_pool_free(struct os_pool *pool, void *ptr);
+void os_pool_destroy(struct os_pool *pool);
+
+/*
+ * Parameters of os_mallopt(); each one can also be set through the
+ * environment variable named after it (e.g. OSMEM_TCACHE=1).
+ */
+#define OS_M_TCACHE		0	/* thread caches: 0 off, 1 on, -1 once a second thread allocates */
+#define OS_M_TCACHE_COUNT	1	/* blocks kept in each thread cache bin */
+#define OS_M_ARENAS		2	/* arenas threads are spread across, 0 for one per CPU */
+#define OS_M_SLAB		3	/* serve allocations of up to 128 bytes from headerless slabs */
+#define OS_M_LARGE_CACHE	4	/* bytes of freed mmap'd blocks kept for reuse */
+#define OS_M_LARGE_DECAY	5	/* milliseconds a cached mmap'd block is kept unused */
+#define OS_M_MREMAP		6	/* resize mmap'd blocks with mremap instead of copying them;
+					   with OS_M_MMAP_DYNAMIC, the settings for buffers that keep growing */
+#define OS_M_TRIM_THRESHOLD	7	/* free bytes at the heap top, or in one block, given back; -1 never */
+#define OS_M_MADV_FREE		8	/* give free pages back with MADV_FREE instead of MADV_DONTNEED */
+#define OS_M_PURGE_INTERVAL	9	/* milliseconds between passes of the purger thread, 0 for none */
+#define OS_M_DIRTY_DECAY	10	/* milliseconds free pages stay dirty before the purger takes them */
+#define OS_M_MUZZY_DECAY	11	/* milliseconds they then stay MADV_FREE'd, 0 to skip that step */
+#define OS_M_HUGEPAGE		12	/* mmap'd blocks of 2 MiB or more: 1 OS_MALLOC_HUGEPAGE, 2 OS_MALLOC_HUGETLB */
+#define OS_M_PROF_SAMPLE	13	/* mean bytes between sampled allocations, 0 for no heap profiling */
+#define OS_M_PROF_SIGNAL	14	/* signal that has a profile dumped, set before the first sample */
+#define OS_M_REMOTE_FREE	15	/* queue blocks freed by threads of other arenas for their arena to bin */
+#define OS_M_POOL_MAGAZINE	16	/* objects each thread keeps per pool, 0 for no magazines */
+#define OS_M_MMAP_THRESHOLD	17	/* bytes from which blocks are mmap'd instead of taken from a heap */
+#define OS_M_MMAP_DYNAMIC	18	/* raise the mmap threshold past the mmap'd blocks that get freed,
+					   until OS_M_MMAP_THRESHOLD or OS_M_TRIM_THRESHOLD is set */
+#define OS_M_HEAP_GROWTH	19	/* largest step the sbrk heap grows by, doubling from 128 KiB; 0 for exact */
+
+int os_mallopt(int param, int value);
+
+/* Statistics of one arena, as reported by os_malloc_arena_stats() */
+struct os_arena_stats {
+	size_t segments;			/* mmap'd segments, 0 for the sbrk heap */
+	unsigned long lock_acquisitions;
+	unsigned long lock_contentions;		/* acquisitions that had to wait */
+	int threads;				/* threads assigned to the arena */
+	unsigned long remote_frees;		/* blocks freed through its remote free list */
+};
+
+/* Fill stats for up to count arenas; returns the number of arenas in use */
+int os_malloc_arena_stats(struct os_arena_stats *stats, int count);
+
+/* Pages given back by the purger, as reported by os_malloc_purge_stats() */
+struct os_purge_stats {
+	unsigned long passes;			/* passes over the arenas and the large cache */
+	unsigned long pages_muzzy;		/* pages given back lazily, with MADV_FREE */
+	unsigned long pages_purged;		/* pages given back with MADV_DONTNEED */
+	unsigned long pages_trimmed;		/* pages cut off the top of the sbrk heap */
+	size_t large_released;			/* bytes of cached mmap'd blocks unmapped */
+};
+
+void os_malloc_purge_stats(struct os_purge_stats *stats);
+
+/* Give every free page back now, whatever its age; returns the pages given back */
+size_t os_malloc_purge(void);
+
+#define OS_STATS_CLASSES 24
+
+/* Statistics of the whole allocator, as reported by os_malloc_stats() */
+struct os_malloc_stats {
+	size_t in_use;				/* payload bytes allocated, from anywhere */
+	size_t sbrk_size;			/* bytes of the sbrk heap */
+	size_t sbrk_free;			/* free payload bytes in it */
+	size_t segment_size;			/* bytes of the segments of the other arenas */
+	size_t segment_free;			/* free payload bytes in them */
+	size_t largest_free;			/* largest free block of the heaps */
+	double fragmentation;			/* 1 - largest_free / free heap bytes */
+	size_t thread_cached;			/* payload bytes of blocks in thread caches */
+	size_t slab_size;			/* bytes of slabs in use */
+	size_t slab_free;			/* free slot bytes in them */
+	size_t mapped;				/* payload bytes of mmap'd blocks */
+	size_t mapped_blocks;
+	size_t large_cached;			/* bytes of freed mmap'd blocks kept for reuse */
+	size_t mmap_threshold;			/* current OS_M_MMAP_THRESHOLD */
+	unsigned long sbrk_calls;
+	unsigned long mmap_calls;		/* slab commits with mprotect included */
+	unsigned long munmap_calls;
+	unsigned long mremap_calls;
+	unsigned long madvise_calls;
+	unsigned long used_blocks[OS_STATS_CLASSES];	/* heap blocks and slab slots in use of up to 16 << i bytes */
+	unsigned long free_blocks[OS_STATS_CLASSES];	/* free heap blocks of up to 16 << i bytes */
+};
+
+/* Fill stats, locking one arena at a time */
+void os_malloc_stats(struct os_malloc_stats *stats);
+
+/* Write the stats as text to fd, without allocating */
+void os_malloc_stats_print(int fd);
+
+/*
+ * Write the allocations sampled with OS_M_PROF_SAMPLE that are still live,
+ * and those made so far, by call site, in the text format of gperftools heap
+ * profiles that pprof reads. A NULL path dumps to
+ * $OSMEM_PROF_PREFIX.<pid>.<seq>.heap, "osmem" if that is not set, as the
+ * profile signal does. Returns 0, or -1 with errno set.
+ */
+int os_malloc_prof_dump(const char *path);
+
+/*
+ * Trace files of os_malloc_trace_start(): an os_trace_header, then one
+ * os_trace_record per call into the API, in the order each thread made
+ * them. A block is released no sooner than the start of the call that
+ * frees it and taken no later than the end of the call that returns it,
+ * so ordering frees by start and allocations by end, and a realloc()
+ * by both, orders the calls of all threads. Setting OSMEM_TRACE to a
+ * path traces the whole run of a program.
+ */
+#define OS_TRACE_MAGIC		"OSMTRACE"
+#define OS_TRACE_VERSION	1
+
+#define OS_TRACE_MALLOC		0	/* size, result; os_malloc(), os_malloc_flags(), os_malloc_batch() */
+#define OS_TRACE_FREE		1	/* ptr, and size for os_free_sized() */
+#define OS_TRACE_CALLOC		2	/* ptr is nmemb, size, result */
+#define OS_TRACE_REALLOC	3	/* ptr, size, result */
+#define OS_TRACE_MEMALIGN	4	/* ptr is the alignment, size, result */
+
+struct os_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct os_trace_record {
+	uint64_t start;				/* nanoseconds since the trace started */
+	uint64_t end;
+	uint32_t thread;			/* threads are numbered as they first call in */
+	uint32_t op;				/* OS_TRACE_* */
+	uint64_t ptr;
+	uint64_t size;
+	uint64_t result;
+};
+
+/* Record every call into the API to path; returns 0, or -1 with errno set */
+int os_malloc_trace_start(const char *path);
+void os_malloc_trace_stop(void);
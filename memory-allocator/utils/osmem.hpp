@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+/*
+ * C++17 adapters over libosmem, header only:
+ *
+ *	osmem::allocator<T>		an STL allocator over os_malloc()
+ *	osmem::heap_resource		a std::pmr::memory_resource over os_malloc()
+ *	osmem::arena_resource		one over a region of os_arena_create(),
+ *					freeing nothing until release()
+ *	osmem::pool_resource		one over os_pool_create() pools, one per
+ *					power of two up to pool_resource::max_pooled
+ *
+ * Failures throw std::bad_alloc. Deallocations pass the size on to
+ * os_free_sized() where the allocation was not over-aligned.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "osmem.h"
+}
+
+namespace osmem {
+
+/* Alignment of every os_malloc() block; larger ones go through os_aligned_alloc() */
+constexpr std::size_t malloc_alignment = OS_MALLOC_ALIGNMENT;
+
+// allocate bytes aligned to align from the heap, throwing if that fails
+inline void *heap_allocate(std::size_t bytes, std::size_t align)
+{
+	void *ptr = align <= malloc_alignment ? os_malloc(bytes ? bytes : 1)
+					      : os_aligned_alloc(align, bytes ? bytes : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+inline void heap_deallocate(void *ptr, std::size_t bytes, std::size_t align)
+{
+	if (align <= malloc_alignment)
+		os_free_sized(ptr, bytes ? bytes : 1);
+	else
+		os_free(ptr);
+}
+
+template <class T>
+struct allocator {
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using is_always_equal = std::true_type;
+
+	allocator() noexcept = default;
+
+	template <class U>
+	allocator(const allocator<U> &) noexcept {}
+
+	T *allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		return static_cast<T *>(heap_allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *ptr, std::size_t n) noexcept
+	{
+		heap_deallocate(ptr, n * sizeof(T), alignof(T));
+	}
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+	return false;
+}
+
+class heap_resource : public std::pmr::memory_resource {
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		return heap_allocate(bytes, align);
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+	{
+		heap_deallocate(ptr, bytes, align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return dynamic_cast<const heap_resource *>(&other) != nullptr;
+	}
+};
+
+// obtain the heap resource all heap users can share
+inline heap_resource *get_heap_resource() noexcept
+{
+	static heap_resource resource;
+
+	return &resource;
+}
+
+/*
+ * A region: allocations bump a pointer and deallocations do nothing, until
+ * release() frees everything at once and keeps the chunks for what comes
+ * next, like std::pmr::monotonic_buffer_resource. Not thread safe.
+ */
+class arena_resource : public std::pmr::memory_resource {
+public:
+	explicit arena_resource(std::size_t chunk_size = 0) : arena_(os_arena_create(chunk_size))
+	{
+		if (!arena_)
+			throw std::bad_alloc();
+	}
+
+	arena_resource(const arena_resource &) = delete;
+	arena_resource &operator=(const arena_resource &) = delete;
+
+	~arena_resource() override
+	{
+		os_arena_destroy(arena_);
+	}
+
+	void release() noexcept
+	{
+		os_arena_reset(arena_);
+	}
+
+	struct os_arena *native_handle() const noexcept
+	{
+		return arena_;
+	}
+
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		void *ptr = os_arena_aligned_alloc(arena_, align, bytes ? bytes : 1);
+
+		if (!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+	struct os_arena *arena_;
+};
+
+/*
+ * Pools for blocks of up to max_pooled bytes, one per power of two from
+ * min_pooled up, created on first use, each aligned to its size up to
+ * max_align; larger blocks, and those aligned to more, come from upstream.
+ * Node based containers then allocate their nodes from the pools. Thread
+ * safe, as pools are; release() frees every pooled block at once.
+ */
+class pool_resource : public std::pmr::memory_resource {
+public:
+	static constexpr std::size_t min_pooled = 8;
+	static constexpr std::size_t max_pooled = 4096;
+	static constexpr std::size_t max_align = 64;
+	static constexpr int classes = 10;
+
+	explicit pool_resource(std::pmr::memory_resource *upstream = get_heap_resource()) noexcept
+		: upstream_(upstream), pools_() {}
+
+	pool_resource(const pool_resource &) = delete;
+	pool_resource &operator=(const pool_resource &) = delete;
+
+	~pool_resource() override
+	{
+		release();
+	}
+
+	void release() noexcept
+	{
+		for (auto &pool : pools_)
+			os_pool_destroy(pool.exchange(nullptr));
+	}
+
+	std::pmr::memory_resource *upstream_resource() const noexcept
+	{
+		return upstream_;
+	}
+
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		int index = pool_class(bytes, align);
+
+		if (index < 0)
+			return upstream_->allocate(bytes, align);
+
+		void *ptr = os_pool_alloc(pool(index));
+
+		if (!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+	{
+		int index = pool_class(bytes, align);
+
+		if (index < 0)
+			upstream_->deallocate(ptr, bytes, align);
+		else
+			os_pool_free(pools_[index].load(std::memory_order_acquire), ptr);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+	// obtain the pool class of a block, -1 if it comes from upstream
+	static int pool_class(std::size_t bytes, std::size_t align) noexcept
+	{
+		std::size_t size = bytes > align ? bytes : align;
+
+		if (size > max_pooled || align > max_align)
+			return -1;
+		if (size <= min_pooled)
+			return 0;
+		// min_pooled is 1 << 3
+		return 64 - __builtin_clzl(size - 1) - 3;
+	}
+
+	// obtain the pool of a class, creating it if no thread did yet
+	struct os_pool *pool(int index)
+	{
+		struct os_pool *pool = pools_[index].load(std::memory_order_acquire);
+
+		if (pool)
+			return pool;
+
+		std::size_t size = min_pooled << index;
+
+		pool = os_pool_create(size, size < max_align ? size : max_align);
+		if (!pool)
+			throw std::bad_alloc();
+
+		struct os_pool *expected = nullptr;
+
+		if (!pools_[index].compare_exchange_strong(expected, pool, std::memory_order_acq_rel)) {
+			os_pool_destroy(pool);
+			return expected;
+		}
+		return pool;
+	}
+
+	std::pmr::memory_resource *upstream_;
+	std::atomic<struct os_pool *> pools_[classes];
+};
+
+} // namespace osmem